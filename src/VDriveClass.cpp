@@ -12,6 +12,7 @@ extern "C"
 #include "diskcontents-block.h"
 #include "imagecontents.h"
 #include "fsimage.h"
+#include "fsimage-cache.h"
 #include <ctype.h>
 }
 
@@ -21,6 +22,9 @@ VDrive::VDrive(uint8_t unit)
   m_drive = (vdrive_t *) lib_calloc(1, sizeof(struct vdrive_s));
   vdrive_device_setup(m_drive, unit);
   m_numOpenChannels = 0;
+  m_cacheSize = FSIMAGE_CACHE_DEFAULT_SIZE;
+  m_cacheMaxDirty = FSIMAGE_CACHE_DEFAULT_MAX_DIRTY;
+  m_cacheInterval = FSIMAGE_CACHE_DEFAULT_INTERVAL;
 }
 
 
@@ -43,7 +47,19 @@ VDrive *VDrive::create(uint8_t unit, const char *imagefile, bool readOnly)
 }
 
 
-bool VDrive::openDiskImage(const char *name, bool readOnly)
+bool VDrive::openDiskImage(const char *name, bool readOnly, bool loadIntoRAM)
+{
+  return openImage(name, NULL, readOnly, loadIntoRAM);
+}
+
+
+bool VDrive::openDiskImageWithDelta(const char *name, const char *deltaName)
+{
+  return openImage(name, deltaName, false, false);
+}
+
+
+bool VDrive::openImage(const char *name, const char *deltaName, bool readOnly, bool loadIntoRAM)
 {
   disk_image_t *image;
 
@@ -58,12 +74,17 @@ bool VDrive::openDiskImage(const char *name, bool readOnly)
   image->p64 = (PP64Image)lib_calloc(1, sizeof(TP64Image));
   P64ImageCreate((PP64Image)image->p64);
   
+  // with a delta file the image itself is never written
   if( readOnly )
     image->read_only = 1;
+  else if( deltaName!=NULL )
+    image->read_only = 0;
   else
     image->read_only = archdep_access(name, ARCHDEP_W_OK)==0 ? 0 : 1;
 
   disk_image_name_set(image, name);
+  disk_image_fsimage_ram_mode_set(image, loadIntoRAM);
+  disk_image_fsimage_overlay_name_set(image, deltaName);
   if (disk_image_open(image) < 0) 
     {
       P64ImageDestroy((PP64Image)image->p64);
@@ -72,7 +93,8 @@ bool VDrive::openDiskImage(const char *name, bool readOnly)
       disk_image_destroy(image);
       return false;
     }
-  
+
+  disk_image_set_write_cache(image, m_cacheSize, m_cacheMaxDirty, m_cacheInterval);
   return vdrive_attach_image(image, m_drive->unit, 0, m_drive)==0;
 }
 
@@ -85,9 +107,11 @@ void VDrive::closeDiskImage()
     {
       vdrive_close_all_channels(m_drive);
       vdrive_detach_image(image, m_drive->unit, 0, m_drive);
+      // closing writes back cached sectors (and P64 data) so the P64
+      // image must only be released afterwards
+      disk_image_close(image);
       P64ImageDestroy((PP64Image)image->p64);
       lib_free(image->p64);
-      disk_image_close(image);
       disk_image_media_destroy(image);
       disk_image_destroy(image);
       m_drive->image = NULL;
@@ -236,10 +260,42 @@ bool VDrive::closeFile(uint8_t channel)
 {
   bool res = vdrive_iec_close(m_drive, channel)==SERIAL_OK;
   countOpenChannels();
+  if( disk_image_flush(m_drive->image)<0 ) res = false;
   return res;
 }
 
 
+bool VDrive::flush()
+{
+  return disk_image_flush(m_drive->image)==0;
+}
+
+
+bool VDrive::poll()
+{
+  return disk_image_poll(m_drive->image)==0;
+}
+
+
+void VDrive::setWriteCache(uint32_t numSectors, uint32_t maxDirty, uint32_t flushInterval)
+{
+  m_cacheSize = numSectors;
+  m_cacheMaxDirty = maxDirty;
+  m_cacheInterval = flushInterval;
+  disk_image_set_write_cache(m_drive->image, m_cacheSize, m_cacheMaxDirty, m_cacheInterval);
+}
+
+
+bool VDrive::setAsyncIO(bool enable)
+{
+  if( enable )
+    return archdep_io_start()==0;
+
+  archdep_io_stop();
+  return true;
+}
+
+
 void VDrive::closeAllChannels()
 {
   vdrive_close_all_channels(m_drive);
@@ -405,6 +461,30 @@ bool VDrive::readSector(uint32_t track, uint32_t sector, uint8_t *buf)
 }
 
 
+bool VDrive::readSectors(uint32_t count, const uint32_t *tracks, const uint32_t *sectors, uint8_t *buf, int *status)
+{
+  if( count==0 ) return true;
+
+  disk_addr_t *list = (disk_addr_t *) lib_malloc(count * sizeof(disk_addr_t));
+  uint8_t **bufs = (uint8_t **) lib_malloc(count * sizeof(uint8_t *));
+  int *errs = status!=NULL ? status : (int *) lib_malloc(count * sizeof(int));
+
+  for(uint32_t i=0; i<count; i++)
+    {
+      list[i].track  = tracks[i];
+      list[i].sector = sectors[i];
+      bufs[i] = buf + 256*i;
+    }
+
+  bool res = vdrive_read_sectors(m_drive, list, count, bufs, errs)==0;
+
+  if( errs!=status ) lib_free(errs);
+  lib_free(bufs);
+  lib_free(list);
+  return res;
+}
+
+
 bool VDrive::writeSector(uint32_t track, uint32_t sector, const uint8_t *buf)
 {
   return vdrive_write_sector(m_drive, buf, track, sector)==CBMDOS_IPE_OK;
@@ -18,7 +18,16 @@ class VDrive
 
   // opens a new disk image on the host file system, using the archdep_* functions
   // to interact with the file system
-  bool openDiskImage(const char *filename, bool readOnly = false);
+  // if loadIntoRAM is true the whole image is read into memory and all accesses are
+  // served from there, changes are written back by flush(), when closing a file or
+  // the image and after the flush interval set by setWriteCache() has passed (see poll())
+  bool openDiskImage(const char *filename, bool readOnly = false, bool loadIntoRAM = false);
+
+  // opens a disk image that may be shared with other drives or processes: the image
+  // file itself is only read, all changes are written to "deltaFilename" which is
+  // created if it does not exist and is read in preference to the image afterwards
+  // (D64/D67/D71/D80/D81/D82, CMD, D90 and G64 images, the image can not grow)
+  bool openDiskImageWithDelta(const char *filename, const char *deltaFilename);
 
   // returns the filename of the currently open disk image (NULL if nothing opened)
   const char *getDiskImageFilename();
@@ -40,6 +49,28 @@ class VDrive
   // close all currently open files on all channels
   void closeAllChannels();
 
+  // write all pending (cached) sector data to the disk image file
+  // returns false if some data could not be written
+  bool flush();
+
+  // write back cached data that is older than the flush interval set by
+  // setWriteCache(), call this regularly (e.g. from the main loop) while the
+  // drive is idle, returns false if some data could not be written
+  bool poll();
+
+  // configure the write-back sector cache used for the disk image:
+  // - numSectors: number of sectors held in the cache (0 disables caching)
+  // - maxDirty: number of unwritten sectors that triggers a flush
+  // - flushInterval: maximum time (in ms) that written data may stay unwritten,
+  //   checked whenever a sector is written and by poll() (0 = no limit)
+  // the cache is always flushed when closing a file or the disk image
+  void setWriteCache(uint32_t numSectors, uint32_t maxDirty, uint32_t flushInterval);
+
+  // start (enable=true) or stop the background I/O worker that writes back cached
+  // sectors while the drive continues processing, this is a global setting for
+  // all drives. Returns false if the platform has no I/O worker.
+  static bool setAsyncIO(bool enable);
+
   // return the number of currently active channels
   int getNumOpenChannels() { return m_numOpenChannels; }
 
@@ -91,6 +122,13 @@ class VDrive
   // "buf" must have a size of at least 256 bytes
   bool readSector(uint32_t track, uint32_t sector, uint8_t *buf);
 
+  // read "count" sectors (given by the "tracks" and "sectors" arrays) from the
+  // disk image into "buf", sector i is placed at buf+256*i
+  // "buf" must have a size of at least count*256 bytes
+  // if "status" is not NULL it receives the CBMDOS error code for each sector
+  // returns true if all sectors were read successfully
+  bool readSectors(uint32_t count, const uint32_t *tracks, const uint32_t *sectors, uint8_t *buf, int *status = NULL);
+
   // write data from "buf" into a sector on the disk image
   // "buf" must have a size of at least 256 bytes
   bool writeSector(uint32_t track, uint32_t sector, const uint8_t *buf);
@@ -107,9 +145,11 @@ class VDrive
 
  private:
   void countOpenChannels();
+  bool openImage(const char *name, const char *deltaName, bool readOnly, bool loadIntoRAM);
 
   int m_numOpenChannels;
   struct vdrive_s *m_drive;
+  uint32_t m_cacheSize, m_cacheMaxDirty, m_cacheInterval;
 };
 
 #endif
@@ -71,6 +71,14 @@ archdep_tm_t *archdep_get_time(archdep_tm_t *ats)
 }
 
 
+uint32_t archdep_ticks_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
 int archdep_access(const char *pathname, int mode)
 {
   int res = 0;
@@ -139,6 +147,13 @@ off_t archdep_file_size(ADFILE *stream)
 }
 
 
+uint64_t archdep_file_mtime(ADFILE *stream)
+{
+  // not available through MStream
+  return 0;
+}
+
+
 archdep_dir_t *archdep_opendir(const char *path, int mode)
 {
   return NULL;
@@ -293,6 +308,105 @@ int archdep_fseek(ADFILE *stream, long int offset, int whence)
 }
 
 
+// positional read/write, emulated by seeking the stream
+size_t archdep_pread(void* buffer, size_t size, size_t count, long int offset, ADFILE *stream)
+{
+  if( archdep_fseek(stream, offset, SEEK_SET)<0 ) return 0;
+  return archdep_fread(buffer, size, count, stream);
+}
+
+
+size_t archdep_pwrite(const void* buffer, size_t size, size_t count, long int offset, ADFILE *stream)
+{
+  if( archdep_fseek(stream, offset, SEEK_SET)<0 ) return 0;
+  return archdep_fwrite(buffer, size, count, stream);
+}
+
+
+size_t archdep_preadv(uint8_t **buffers, size_t size, size_t count, long int offset, ADFILE *stream)
+{
+  size_t done = 0;
+  while( done<count && archdep_pread(buffers[done], size, 1, offset + (long int) (done * size), stream)==1 )
+    done++;
+  return done;
+}
+
+
+// no I/O worker on this platform, asynchronous requests are executed immediately
+int archdep_io_start(void)
+{
+  return -1;
+}
+
+
+void archdep_io_stop(void)
+{
+}
+
+
+void archdep_io_wait(void)
+{
+}
+
+
+// no threads on this platform, the work is done by the caller
+void archdep_parallel_for(unsigned int count, archdep_work_func_t func, void *param)
+{
+  for(unsigned int i=0; i<count; i++) func(param, i);
+}
+
+
+// no threads on this platform, locks are no-ops
+void archdep_mutex_init(archdep_mutex_t *mutex)
+{
+}
+
+
+void archdep_mutex_destroy(archdep_mutex_t *mutex)
+{
+}
+
+
+void archdep_mutex_lock(archdep_mutex_t *mutex)
+{
+}
+
+
+void archdep_mutex_unlock(archdep_mutex_t *mutex)
+{
+}
+
+
+int archdep_aread(void* buffer, size_t size, size_t count, long int offset, ADFILE *stream,
+                  archdep_io_callback_t callback, void *param)
+{
+  size_t n = archdep_pread(buffer, size, count, offset, stream);
+  if( callback!=NULL ) callback(param, n);
+  return 0;
+}
+
+
+int archdep_awrite(const void* buffer, size_t size, size_t count, long int offset, ADFILE *stream,
+                   archdep_io_callback_t callback, void *param)
+{
+  size_t n = archdep_pwrite(buffer, size, count, offset, stream);
+  if( callback!=NULL ) callback(param, n);
+  return 0;
+}
+
+
+void *archdep_fmap(ADFILE *file, size_t len, int writable)
+{
+  // memory mapped files are not available on this platform
+  return NULL;
+}
+
+
+void archdep_funmap(void *addr, size_t len)
+{
+}
+
+
 int archdep_fflush(ADFILE *stream)
 {
   return 0;
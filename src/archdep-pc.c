@@ -3,11 +3,15 @@
 #ifdef WIN32
 #include <windows.h>
 #else
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #define _ftelli64 ftell
 #define _fseeki64 fseek
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
@@ -68,6 +72,18 @@ archdep_tm_t *archdep_get_time(archdep_tm_t *ats)
 }
 
 
+uint32_t archdep_ticks_ms(void)
+{
+#ifdef WIN32
+  return (uint32_t) GetTickCount();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
+
 int archdep_expand_path(char **return_path, const char *orig_name)
 {
   *return_path = lib_strdup(orig_name);
@@ -152,6 +168,8 @@ off_t archdep_file_size(ADFILE *stream)
 {
   off_t pos, end;
 
+  // queued writes may still extend the file
+  archdep_io_wait();
   pos = ftell(stream);
   fseek(stream, 0, SEEK_END);
   end = ftell(stream);
@@ -162,6 +180,52 @@ off_t archdep_file_size(ADFILE *stream)
 }
 
 
+uint64_t archdep_file_mtime(ADFILE *stream)
+{
+  struct stat statrec;
+
+  archdep_io_wait();
+  if( fstat(fileno(stream), &statrec)!=0 )
+    return 0;
+
+#ifdef __linux__
+  return (uint64_t) statrec.st_mtim.tv_sec * 1000000000u + (uint64_t) statrec.st_mtim.tv_nsec;
+#else
+  return (uint64_t) statrec.st_mtime;
+#endif
+}
+
+
+void *archdep_fmap(ADFILE *file, size_t len, int writable)
+{
+#ifdef WIN32
+  return NULL;
+#else
+  void *addr;
+
+  if( len==0 )
+    return NULL;
+
+  // make sure pending buffered writes are in the file before mapping it
+  archdep_io_wait();
+  fflush(file);
+  addr = mmap(NULL, len, writable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fileno(file), 0);
+
+  DBG(("archdep_fmap: %p %u %i => %p\n", file, (uint32_t) len, writable, addr));
+  return addr==MAP_FAILED ? NULL : addr;
+#endif
+}
+
+
+void archdep_funmap(void *addr, size_t len)
+{
+#ifndef WIN32
+  DBG(("archdep_funmap: %p %u\n", addr, (uint32_t) len));
+  munmap(addr, len);
+#endif
+}
+
+
 archdep_dir_t *archdep_opendir(const char *path, int mode)
 {
   return NULL;
@@ -210,6 +274,7 @@ ADFILE *archdep_fopen(const char* filename, const char* mode)
 int archdep_fclose(ADFILE *file)
 {
   DBG(("archdep_fclose: %p\n", file));
+  archdep_io_wait();
   return fclose(file);
 }
 
@@ -217,6 +282,7 @@ int archdep_fclose(ADFILE *file)
 size_t archdep_fread(void* buffer, size_t size, size_t count, ADFILE *stream)
 {
   DBG(("archdep_fread: %p %u %u ", stream, (uint32_t) size, (uint32_t) count));
+  archdep_io_wait();
   size_t n = fread(buffer, size, count, stream);
   DBG(("=> %i %u %u\n", ferror(stream), (uint32_t) n, (uint32_t) ftell(stream)));
   return n;
@@ -232,15 +298,449 @@ int archdep_fgetc(ADFILE *stream)
 size_t archdep_fwrite(const void* buffer, size_t size, size_t count, ADFILE *stream)
 {
   DBG(("archdep_fwrite: %p %u %u ", stream, (uint32_t) size, (uint32_t) count));
+  archdep_io_wait();
   size_t n = fwrite(buffer, size, count, stream);
   DBG(("=> %i %u\n", ferror(stream), (uint32_t) n));
   return n;
 }
 
 
+// Positional I/O bypasses the stdio buffer of the stream, which the probe,
+// image creation and G64 track appends still use. Before switching from
+// stdio to positional I/O, write out what fwrite buffered and drop what
+// fread buffered (fflush discards the read buffer of seekable streams), so
+// neither can go stale against or overwrite the positional transfers.
+static void archdep_stdio_release(ADFILE *stream)
+{
+#ifndef WIN32
+  fflush(stream);
+#endif
+}
+
+
+// positional read/write, does not use (or change) the stream position
+static size_t archdep_pread_direct(void* buffer, size_t size, size_t count, long int offset, ADFILE *stream)
+{
+  DBG(("archdep_pread: %p %u %u %li ", stream, (uint32_t) size, (uint32_t) count, offset));
+#ifdef WIN32
+  size_t n = fseek(stream, offset, SEEK_SET)==0 ? fread(buffer, size, count, stream) : 0;
+#else
+  size_t total = size * count, done = 0;
+  while( done<total )
+    {
+      ssize_t r = pread(fileno(stream), (uint8_t *) buffer + done, total - done, offset + done);
+      if( r<0 && errno==EINTR ) continue;
+      if( r<=0 ) break;
+      done += r;
+    }
+  size_t n = size>0 ? done / size : 0;
+#endif
+  DBG(("=> %u\n", (uint32_t) n));
+  return n;
+}
+
+
+static size_t archdep_pwrite_direct(const void* buffer, size_t size, size_t count, long int offset, ADFILE *stream)
+{
+  DBG(("archdep_pwrite: %p %u %u %li ", stream, (uint32_t) size, (uint32_t) count, offset));
+#ifdef WIN32
+  size_t n = fseek(stream, offset, SEEK_SET)==0 ? fwrite(buffer, size, count, stream) : 0;
+#else
+  size_t total = size * count, done = 0;
+  while( done<total )
+    {
+      ssize_t r = pwrite(fileno(stream), (const uint8_t *) buffer + done, total - done, offset + done);
+      if( r<0 && errno==EINTR ) continue;
+      if( r<=0 ) break;
+      done += r;
+    }
+  size_t n = size>0 ? done / size : 0;
+#endif
+  DBG(("=> %u\n", (uint32_t) n));
+  return n;
+}
+
+
+
+#ifndef WIN32
+
+// --- I/O worker thread
+
+typedef struct archdep_io_req_s {
+  struct archdep_io_req_s *next;
+  int write;
+  void *buffer;
+  size_t size, count;
+  long int offset;
+  ADFILE *stream;
+  archdep_io_callback_t callback;
+  void *param;
+} archdep_io_req_t;
+
+static pthread_t         io_thread;
+static pthread_mutex_t   io_lock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    io_wakeup = PTHREAD_COND_INITIALIZER; // new request or stop
+static pthread_cond_t    io_idle   = PTHREAD_COND_INITIALIZER; // request completed
+static archdep_io_req_t *io_head = NULL, *io_tail = NULL;
+static unsigned int      io_pending = 0;
+static int               io_running = 0, io_stopping = 0;
+
+
+static void *archdep_io_worker(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&io_lock);
+  for(;;)
+    {
+      while( io_head==NULL && !io_stopping ) pthread_cond_wait(&io_wakeup, &io_lock);
+      if( io_head==NULL ) break;
+
+      archdep_io_req_t *req = io_head;
+      io_head = req->next;
+      if( io_head==NULL ) io_tail = NULL;
+      pthread_mutex_unlock(&io_lock);
+
+      size_t n = req->write ? archdep_pwrite_direct(req->buffer, req->size, req->count, req->offset, req->stream)
+                            : archdep_pread_direct(req->buffer, req->size, req->count, req->offset, req->stream);
+
+      // callbacks run with io_lock held, so whatever they record (e.g. an
+      // error flag) is visible to threads that waited for the queue
+      pthread_mutex_lock(&io_lock);
+      if( req->callback!=NULL ) req->callback(req->param, n);
+      free(req);
+      io_pending--;
+      pthread_cond_broadcast(&io_idle);
+    }
+  pthread_mutex_unlock(&io_lock);
+  return NULL;
+}
+
+
+static int archdep_io_submit(int write, void *buffer, size_t size, size_t count, long int offset,
+                             ADFILE *stream, archdep_io_callback_t callback, void *param)
+{
+  archdep_io_req_t *req = (archdep_io_req_t *) malloc(sizeof(archdep_io_req_t));
+  if( req==NULL ) return -1;
+
+  req->next     = NULL;
+  req->write    = write;
+  req->buffer   = buffer;
+  req->size     = size;
+  req->count    = count;
+  req->offset   = offset;
+  req->stream   = stream;
+  req->callback = callback;
+  req->param    = param;
+
+  pthread_mutex_lock(&io_lock);
+  if( !io_running )
+    {
+      // no worker: execute immediately, the callback runs without io_lock
+      pthread_mutex_unlock(&io_lock);
+      size_t n = write ? archdep_pwrite_direct(buffer, size, count, offset, stream)
+                       : archdep_pread_direct(buffer, size, count, offset, stream);
+      if( callback!=NULL ) callback(param, n);
+      free(req);
+      return 0;
+    }
+
+  if( io_tail!=NULL ) io_tail->next = req; else io_head = req;
+  io_tail = req;
+  io_pending++;
+  pthread_cond_signal(&io_wakeup);
+  pthread_mutex_unlock(&io_lock);
+  return 0;
+}
+
+
+int archdep_io_start(void)
+{
+  int res = 0;
+
+  pthread_mutex_lock(&io_lock);
+  if( !io_running )
+    {
+      if( pthread_create(&io_thread, NULL, archdep_io_worker, NULL)==0 )
+        io_running = 1;
+      else
+        res = -1;
+    }
+  pthread_mutex_unlock(&io_lock);
+
+  DBG(("archdep_io_start: %i\n", res));
+  return res;
+}
+
+
+void archdep_io_stop(void)
+{
+  // the worker finishes all queued requests before exiting
+  pthread_mutex_lock(&io_lock);
+  if( !io_running || io_stopping )
+    {
+      pthread_mutex_unlock(&io_lock);
+      return;
+    }
+  io_stopping = 1;
+  pthread_cond_signal(&io_wakeup);
+  pthread_mutex_unlock(&io_lock);
+
+  pthread_join(io_thread, NULL);
+
+  pthread_mutex_lock(&io_lock);
+  io_running = 0;
+  io_stopping = 0;
+  pthread_mutex_unlock(&io_lock);
+  DBG(("archdep_io_stop\n"));
+}
+
+
+void archdep_io_wait(void)
+{
+  pthread_mutex_lock(&io_lock);
+  while( io_pending>0 ) pthread_cond_wait(&io_idle, &io_lock);
+  pthread_mutex_unlock(&io_lock);
+}
+
+
+// synchronous requests do not go through the worker: once the queued
+// requests are done they run on the calling thread, so drives that do not
+// use asynchronous writes never wait for one another
+static size_t archdep_io_sync(int write, void *buffer, size_t size, size_t count, long int offset, ADFILE *stream)
+{
+  archdep_io_wait();
+  return write ? archdep_pwrite_direct(buffer, size, count, offset, stream)
+               : archdep_pread_direct(buffer, size, count, offset, stream);
+}
+
+
+// --- parallel work
+// The threads only live for one call. That is cheap enough for the few P64
+// half tracks that still need decoding or encoding, and calls with a single
+// item create none.
+
+#define ARCHDEP_MAX_WORKERS 16
+
+typedef struct {
+  pthread_mutex_t lock;
+  unsigned int next, count;
+  archdep_work_func_t func;
+  void *param;
+} archdep_work_t;
+
+
+static void *archdep_work_worker(void *arg)
+{
+  archdep_work_t *work = (archdep_work_t *) arg;
+  for(;;)
+    {
+      pthread_mutex_lock(&work->lock);
+      unsigned int i = work->next<work->count ? work->next++ : work->count;
+      pthread_mutex_unlock(&work->lock);
+      if( i>=work->count ) break;
+      work->func(work->param, i);
+    }
+  return NULL;
+}
+
+
+void archdep_parallel_for(unsigned int count, archdep_work_func_t func, void *param)
+{
+  pthread_t threads[ARCHDEP_MAX_WORKERS];
+  archdep_work_t work;
+  unsigned int i, num, started;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  num = cpus>1 ? (unsigned int) cpus : 1;
+  if( num>ARCHDEP_MAX_WORKERS ) num = ARCHDEP_MAX_WORKERS;
+  if( num>count ) num = count;
+
+  pthread_mutex_init(&work.lock, NULL);
+  work.next  = 0;
+  work.count = count;
+  work.func  = func;
+  work.param = param;
+
+  // the calling thread is one of the workers, if threads can not be
+  // created it does all of the work
+  for(started=0; started+1<num; started++)
+    if( pthread_create(&threads[started], NULL, archdep_work_worker, &work)!=0 )
+      break;
+
+  archdep_work_worker(&work);
+  for(i=0; i<started; i++) pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&work.lock);
+}
+
+
+// --- locks
+
+void archdep_mutex_init(archdep_mutex_t *mutex)
+{
+  pthread_mutex_init(mutex, NULL);
+}
+
+
+void archdep_mutex_destroy(archdep_mutex_t *mutex)
+{
+  pthread_mutex_destroy(mutex);
+}
+
+
+void archdep_mutex_lock(archdep_mutex_t *mutex)
+{
+  pthread_mutex_lock(mutex);
+}
+
+
+void archdep_mutex_unlock(archdep_mutex_t *mutex)
+{
+  pthread_mutex_unlock(mutex);
+}
+
+#else
+
+// no worker thread on Windows, all requests are executed immediately
+
+int archdep_io_start(void)
+{
+  return -1;
+}
+
+
+void archdep_io_stop(void)
+{
+}
+
+
+void archdep_io_wait(void)
+{
+}
+
+
+static int archdep_io_submit(int write, void *buffer, size_t size, size_t count, long int offset,
+                             ADFILE *stream, archdep_io_callback_t callback, void *param)
+{
+  size_t n = write ? archdep_pwrite_direct(buffer, size, count, offset, stream)
+                   : archdep_pread_direct(buffer, size, count, offset, stream);
+  if( callback!=NULL ) callback(param, n);
+  return 0;
+}
+
+
+static size_t archdep_io_sync(int write, void *buffer, size_t size, size_t count, long int offset, ADFILE *stream)
+{
+  return write ? archdep_pwrite_direct(buffer, size, count, offset, stream)
+               : archdep_pread_direct(buffer, size, count, offset, stream);
+}
+
+
+void archdep_parallel_for(unsigned int count, archdep_work_func_t func, void *param)
+{
+  for(unsigned int i=0; i<count; i++) func(param, i);
+}
+
+
+void archdep_mutex_init(archdep_mutex_t *mutex)
+{
+}
+
+
+void archdep_mutex_destroy(archdep_mutex_t *mutex)
+{
+}
+
+
+void archdep_mutex_lock(archdep_mutex_t *mutex)
+{
+}
+
+
+void archdep_mutex_unlock(archdep_mutex_t *mutex)
+{
+}
+
+#endif
+
+
+int archdep_aread(void* buffer, size_t size, size_t count, long int offset, ADFILE *stream,
+                  archdep_io_callback_t callback, void *param)
+{
+  DBG(("archdep_aread: %p %u %u %li\n", stream, (uint32_t) size, (uint32_t) count, offset));
+  archdep_stdio_release(stream);
+  return archdep_io_submit(0, buffer, size, count, offset, stream, callback, param);
+}
+
+
+int archdep_awrite(const void* buffer, size_t size, size_t count, long int offset, ADFILE *stream,
+                   archdep_io_callback_t callback, void *param)
+{
+  DBG(("archdep_awrite: %p %u %u %li\n", stream, (uint32_t) size, (uint32_t) count, offset));
+  archdep_stdio_release(stream);
+  return archdep_io_submit(1, (void *) buffer, size, count, offset, stream, callback, param);
+}
+
+
+size_t archdep_pread(void* buffer, size_t size, size_t count, long int offset, ADFILE *stream)
+{
+  archdep_stdio_release(stream);
+  return archdep_io_sync(0, buffer, size, count, offset, stream);
+}
+
+
+size_t archdep_pwrite(const void* buffer, size_t size, size_t count, long int offset, ADFILE *stream)
+{
+  archdep_stdio_release(stream);
+  return archdep_io_sync(1, (void *) buffer, size, count, offset, stream);
+}
+
+
+// positional read of "count" consecutive blocks of "size" bytes into
+// separate buffers, returns the number of blocks read
+size_t archdep_preadv(uint8_t **buffers, size_t size, size_t count, long int offset, ADFILE *stream)
+{
+  size_t done = 0;
+  DBG(("archdep_preadv: %p %u %u %li ", stream, (uint32_t) size, (uint32_t) count, offset));
+  archdep_io_wait();
+  archdep_stdio_release(stream);
+#ifdef WIN32
+  while( done<count && archdep_pread_direct(buffers[done], size, 1, offset + (long int) (done * size), stream)==1 )
+    done++;
+#else
+  struct iovec iov[64];
+  while( done<count )
+    {
+      size_t i, n = count - done > 64 ? 64 : count - done;
+      for(i=0; i<n; i++)
+        {
+          iov[i].iov_base = buffers[done + i];
+          iov[i].iov_len  = size;
+        }
+
+      ssize_t r = preadv(fileno(stream), iov, (int) n, offset + (long int) (done * size));
+      if( r<0 && errno==EINTR ) continue;
+      if( r<=0 ) break;
+
+      if( (size_t) r < n * size )
+        {
+          // short read: complete the partially filled buffer on its own
+          done += (size_t) r / size;
+          if( archdep_pread_direct(buffers[done], size, 1, offset + (long int) (done * size), stream)<1 ) break;
+          done++;
+        }
+      else
+        done += n;
+    }
+#endif
+  DBG(("=> %u\n", (uint32_t) done));
+  return done;
+}
+
+
 long int archdep_ftell(ADFILE *stream)
 {
   DBG(("archdep_ftell: %p ", stream));
+  archdep_io_wait();
   long int res = (long int) ftell(stream);
   DBG(("=> %li\n", res));
   return res;
@@ -250,6 +750,7 @@ long int archdep_ftell(ADFILE *stream)
 int archdep_fseek(ADFILE *stream, long int offset, int whence)
 {
   DBG(("archdep_fseek: %p %i %li ", stream, whence, offset));
+  archdep_io_wait();
   int res = fseek(stream, offset, whence);
   DBG(("=> %i %lu\n", res, ftell(stream)));
   return res;
@@ -258,6 +759,7 @@ int archdep_fseek(ADFILE *stream, long int offset, int whence)
 
 int archdep_fflush(ADFILE *file)
 {
+  archdep_io_wait();
   return fflush(file);
 }
 
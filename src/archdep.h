@@ -38,6 +38,16 @@ typedef FILE ADFILE;
 #error "unsupported platform"
 #endif
 
+#if defined(__GNUC__) && !defined(ARDUINO) && !defined(ESP_PLATFORM) && !defined(WIN32)
+#include <pthread.h>
+typedef pthread_mutex_t archdep_mutex_t;
+#define ARCHDEP_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#else
+// no threads, locks are no-ops
+typedef int archdep_mutex_t;
+#define ARCHDEP_MUTEX_INITIALIZER 0
+#endif
+
 
 /* Modes for fopen().  */
 #define MODE_READ              "rb"
@@ -110,6 +120,7 @@ int archdep_default_logger(const char *level_string, const char *txt);
 int archdep_default_logger_is_terminal(void);
 int archdep_expand_path(char **return_path, const char *orig_name);
 archdep_tm_t *archdep_get_time(archdep_tm_t *ts);
+uint32_t archdep_ticks_ms(void);
 void archdep_exit(int excode);
 
 // --- file functions
@@ -120,14 +131,57 @@ int    archdep_ferror(ADFILE *file);
 int    archdep_fclose(ADFILE *file);
 size_t archdep_fread(void* buffer, size_t size, size_t count, ADFILE *stream);
 size_t archdep_fwrite(const void* buffer, size_t size, size_t count, ADFILE *stream);
+size_t archdep_pread(void* buffer, size_t size, size_t count, long int offset, ADFILE *stream);
+size_t archdep_pwrite(const void* buffer, size_t size, size_t count, long int offset, ADFILE *stream);
+size_t archdep_preadv(uint8_t **buffers, size_t size, size_t count, long int offset, ADFILE *stream);
 int    archdep_fflush(ADFILE *file);
 long int archdep_ftell(ADFILE *stream);
 int    archdep_fseek(ADFILE *stream, long int offset, int whence);
 void   archdep_frewind(ADFILE *file);
 int    archdep_fissame(ADFILE *file1, ADFILE *file2);
 off_t  archdep_file_size(ADFILE *stream);
+uint64_t archdep_file_mtime(ADFILE *stream); // only compared for equality, 0 if unknown
 char  *archdep_tmpnam(void);
 
+// --- asynchronous positional read/write
+// Requests are executed in submission order by the I/O worker thread if the
+// backend has one and it has been started, otherwise immediately. The callback
+// receives the number of complete items transferred and may be called from the
+// worker thread, with the queue locked: it must be short, must not issue file
+// I/O or wait for other requests, and what it stores is seen by any thread that
+// afterwards waited for the queue (archdep_io_wait or any synchronous file
+// function). Synchronous file functions, archdep_pread/archdep_pwrite included,
+// first wait until the queue is empty and then run on the calling thread, so
+// only asynchronous requests are serialised by the (single) worker.
+typedef void (*archdep_io_callback_t)(void *param, size_t count);
+int    archdep_io_start(void);
+void   archdep_io_stop(void);
+void   archdep_io_wait(void);
+int    archdep_aread(void* buffer, size_t size, size_t count, long int offset, ADFILE *stream,
+                     archdep_io_callback_t callback, void *param);
+int    archdep_awrite(const void* buffer, size_t size, size_t count, long int offset, ADFILE *stream,
+                      archdep_io_callback_t callback, void *param);
+
+// --- parallel work
+// Calls func(param, i) for every i in 0..count-1, spread over worker threads
+// if the backend has them, otherwise one after another. Returns when all calls
+// have finished. There is no pool, threads are created for each call (only if
+// count>1), so callers only pass the items that need real work: P64 images
+// hand over the half tracks split into several chunks on reading and the
+// modified ones on writing, usually none or a few.
+typedef void (*archdep_work_func_t)(void *param, unsigned int index);
+void   archdep_parallel_for(unsigned int count, archdep_work_func_t func, void *param);
+
+// --- locks (static ones are initialized with ARCHDEP_MUTEX_INITIALIZER)
+void   archdep_mutex_init(archdep_mutex_t *mutex);
+void   archdep_mutex_destroy(archdep_mutex_t *mutex);
+void   archdep_mutex_lock(archdep_mutex_t *mutex);
+void   archdep_mutex_unlock(archdep_mutex_t *mutex);
+
+// --- memory mapped files (archdep_fmap returns NULL if not supported)
+void  *archdep_fmap(ADFILE *file, size_t len, int writable);
+void   archdep_funmap(void *addr, size_t len);
+
 bool archdep_file_exists(const char *path);
 int  archdep_remove(const char *path);
 int  archdep_rename(const char *oldpath, const char *newpath);
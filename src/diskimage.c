@@ -61,99 +61,325 @@ static log_t disk_image_log = LOG_DEFAULT;
 
 
 /*-----------------------------------------------------------------------*/
-/* Speed zones */
+/* Geometry of zoned formats */
+
+/* Per track speed zone, number of sectors and offset (in sectors) of the
+   first sector of the track in the image.  Double sided formats continue the
+   tables on the second side, entry 0 is never a valid track. */
+
+/* D64/X64/G64/P64, tracks 1-42 */
+static const uint8_t zone_d64[43] = {
+    3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 2, 2, 2,
+    2, 2, 2, 2, 1, 1, 1, 1, 1, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0
+};
 
-/** \brief  Determine the speed zone for \a track in \a format
- *
- * The speed zone determines the number of sectors containing in a track for
- * a given image type. Speed zone 0 is closest to the disk center (containing
- * the smallest number of sectors for a speed zone), 3 is farthest away
- * (containing the largest number of sectors for a speed zone).
+static const uint8_t sectors_d64[43] = {
+    21,
+    21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 21, 21, 21, 21, 21, 21, 19, 19, 19,
+    19, 19, 19, 19, 18, 18, 18, 18, 18, 18,
+    17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+    17, 17
+};
+
+static const uint16_t offset_d64[43] = {
+       0,
+       0,   21,   42,   63,   84,  105,  126,  147,  168,  189,
+     210,  231,  252,  273,  294,  315,  336,  357,  376,  395,
+     414,  433,  452,  471,  490,  508,  526,  544,  562,  580,
+     598,  615,  632,  649,  666,  683,  700,  717,  734,  751,
+     768,  785
+};
+
+static const disk_image_geometry_t geometry_d64 = {
+    42, zone_d64, sectors_d64, offset_d64
+};
+
+/* D67, tracks 1-35 */
+static const uint8_t zone_d67[36] = {
+    3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 2, 2, 2,
+    2, 2, 2, 2, 1, 1, 1, 1, 1, 1,
+    0, 0, 0, 0, 0
+};
+
+static const uint8_t sectors_d67[36] = {
+    21,
+    21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 21, 21, 21, 21, 21, 21, 20, 20, 20,
+    20, 20, 20, 20, 18, 18, 18, 18, 18, 18,
+    17, 17, 17, 17, 17
+};
+
+static const uint16_t offset_d67[36] = {
+       0,
+       0,   21,   42,   63,   84,  105,  126,  147,  168,  189,
+     210,  231,  252,  273,  294,  315,  336,  357,  377,  397,
+     417,  437,  457,  477,  497,  515,  533,  551,  569,  587,
+     605,  622,  639,  656,  673
+};
+
+static const disk_image_geometry_t geometry_d67 = {
+    35, zone_d67, sectors_d67, offset_d67
+};
+
+/* D71, tracks 1-70 */
+static const uint8_t zone_d71[71] = {
+    3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 2, 2, 2,
+    2, 2, 2, 2, 1, 1, 1, 1, 1, 1,
+    0, 0, 0, 0, 0, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 2, 2, 2, 2, 2, 2, 2, 1,
+    1, 1, 1, 1, 1, 0, 0, 0, 0, 0
+};
+
+static const uint8_t sectors_d71[71] = {
+    21,
+    21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 21, 21, 21, 21, 21, 21, 19, 19, 19,
+    19, 19, 19, 19, 18, 18, 18, 18, 18, 18,
+    17, 17, 17, 17, 17, 21, 21, 21, 21, 21,
+    21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 21, 19, 19, 19, 19, 19, 19, 19, 18,
+    18, 18, 18, 18, 18, 17, 17, 17, 17, 17
+};
+
+static const uint16_t offset_d71[71] = {
+       0,
+       0,   21,   42,   63,   84,  105,  126,  147,  168,  189,
+     210,  231,  252,  273,  294,  315,  336,  357,  376,  395,
+     414,  433,  452,  471,  490,  508,  526,  544,  562,  580,
+     598,  615,  632,  649,  666,  683,  704,  725,  746,  767,
+     788,  809,  830,  851,  872,  893,  914,  935,  956,  977,
+     998, 1019, 1040, 1059, 1078, 1097, 1116, 1135, 1154, 1173,
+    1191, 1209, 1227, 1245, 1263, 1281, 1298, 1315, 1332, 1349
+};
+
+static const disk_image_geometry_t geometry_d71 = {
+    70, zone_d71, sectors_d71, offset_d71
+};
+
+/* G71, tracks 1-84 */
+static const uint8_t zone_g71[85] = {
+    3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 2, 2, 2,
+    2, 2, 2, 2, 1, 1, 1, 1, 1, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 2,
+    2, 2, 2, 2, 2, 2, 1, 1, 1, 1,
+    1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0
+};
+
+static const uint8_t sectors_g71[85] = {
+    21,
+    21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 21, 21, 21, 21, 21, 21, 19, 19, 19,
+    19, 19, 19, 19, 18, 18, 18, 18, 18, 18,
+    17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+    17, 17, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 21, 21, 21, 21, 21, 21, 21, 21, 19,
+    19, 19, 19, 19, 19, 19, 18, 18, 18, 18,
+    18, 18, 17, 17, 17, 17, 17, 17, 17, 17,
+    17, 17, 17, 17
+};
+
+static const uint16_t offset_g71[85] = {
+       0,
+       0,   21,   42,   63,   84,  105,  126,  147,  168,  189,
+     210,  231,  252,  273,  294,  315,  336,  357,  376,  395,
+     414,  433,  452,  471,  490,  508,  526,  544,  562,  580,
+     598,  615,  632,  649,  666,  683,  700,  717,  734,  751,
+     768,  785,  802,  823,  844,  865,  886,  907,  928,  949,
+     970,  991, 1012, 1033, 1054, 1075, 1096, 1117, 1138, 1159,
+    1178, 1197, 1216, 1235, 1254, 1273, 1292, 1310, 1328, 1346,
+    1364, 1382, 1400, 1417, 1434, 1451, 1468, 1485, 1502, 1519,
+    1536, 1553, 1570, 1587
+};
+
+static const disk_image_geometry_t geometry_g71 = {
+    84, zone_g71, sectors_g71, offset_g71
+};
+
+/* D80, tracks 1-77 */
+static const uint8_t zone_d80[78] = {
+    3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0
+};
+
+static const uint8_t sectors_d80[78] = {
+    29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 27,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 27, 27, 25, 25, 25, 25, 25, 25, 25,
+    25, 25, 25, 25, 23, 23, 23, 23, 23, 23,
+    23, 23, 23, 23, 23, 23, 23
+};
+
+static const uint16_t offset_d80[78] = {
+       0,
+       0,   29,   58,   87,  116,  145,  174,  203,  232,  261,
+     290,  319,  348,  377,  406,  435,  464,  493,  522,  551,
+     580,  609,  638,  667,  696,  725,  754,  783,  812,  841,
+     870,  899,  928,  957,  986, 1015, 1044, 1073, 1102, 1131,
+    1158, 1185, 1212, 1239, 1266, 1293, 1320, 1347, 1374, 1401,
+    1428, 1455, 1482, 1509, 1534, 1559, 1584, 1609, 1634, 1659,
+    1684, 1709, 1734, 1759, 1784, 1807, 1830, 1853, 1876, 1899,
+    1922, 1945, 1968, 1991, 2014, 2037, 2060
+};
+
+static const disk_image_geometry_t geometry_d80 = {
+    77, zone_d80, sectors_d80, offset_d80
+};
+
+/* D82, tracks 1-154 */
+static const uint8_t zone_d82[155] = {
+    3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    3, 3, 3, 3, 3, 3, 2, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0
+};
+
+static const uint8_t sectors_d82[155] = {
+    29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 27,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 27, 27, 25, 25, 25, 25, 25, 25, 25,
+    25, 25, 25, 25, 23, 23, 23, 23, 23, 23,
+    23, 23, 23, 23, 23, 23, 23, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 27, 27, 27, 27,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    25, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+    23, 23, 23, 23
+};
+
+static const uint16_t offset_d82[155] = {
+       0,
+       0,   29,   58,   87,  116,  145,  174,  203,  232,  261,
+     290,  319,  348,  377,  406,  435,  464,  493,  522,  551,
+     580,  609,  638,  667,  696,  725,  754,  783,  812,  841,
+     870,  899,  928,  957,  986, 1015, 1044, 1073, 1102, 1131,
+    1158, 1185, 1212, 1239, 1266, 1293, 1320, 1347, 1374, 1401,
+    1428, 1455, 1482, 1509, 1534, 1559, 1584, 1609, 1634, 1659,
+    1684, 1709, 1734, 1759, 1784, 1807, 1830, 1853, 1876, 1899,
+    1922, 1945, 1968, 1991, 2014, 2037, 2060, 2083, 2112, 2141,
+    2170, 2199, 2228, 2257, 2286, 2315, 2344, 2373, 2402, 2431,
+    2460, 2489, 2518, 2547, 2576, 2605, 2634, 2663, 2692, 2721,
+    2750, 2779, 2808, 2837, 2866, 2895, 2924, 2953, 2982, 3011,
+    3040, 3069, 3098, 3127, 3156, 3185, 3214, 3241, 3268, 3295,
+    3322, 3349, 3376, 3403, 3430, 3457, 3484, 3511, 3538, 3565,
+    3592, 3617, 3642, 3667, 3692, 3717, 3742, 3767, 3792, 3817,
+    3842, 3867, 3890, 3913, 3936, 3959, 3982, 4005, 4028, 4051,
+    4074, 4097, 4120, 4143
+};
+
+static const disk_image_geometry_t geometry_d82 = {
+    154, zone_d82, sectors_d82, offset_d82
+};
+
+
+/** \brief  Get the precomputed geometry of a zoned disk format
  *
  * \param[in]   format  disk image type enumerator
- * \param[in]   track   track number
  *
- * \return  speed zone (0-3)
+ * \return  geometry descriptor or NULL if \a format has no speed zones
  */
-
-unsigned int disk_image_speed_map(unsigned int format, unsigned int track)
+const disk_image_geometry_t *disk_image_geometry(unsigned int format)
 {
     switch (format) {
-
-        /* single sided format, these are straight forward */
-        case DISK_IMAGE_TYPE_D67:
         case DISK_IMAGE_TYPE_D64:
 #ifdef HAVE_X64_IMAGE
         case DISK_IMAGE_TYPE_X64:
 #endif
         case DISK_IMAGE_TYPE_G64:
         case DISK_IMAGE_TYPE_P64:
-            return (track < 31) + (track < 25) + (track < 18);
-        case DISK_IMAGE_TYPE_D80:
-            return (track < 65) + (track < 54) + (track < 40);
-
-        /* double sided formats - these need extra care */
-        case DISK_IMAGE_TYPE_D82:
-            /* FIXME: what about 80 track D82s? */
-            if (track > 77) {
-                track -= 77;
-            }
-            return (track < 65) + (track < 54) + (track < 40);
+            return &geometry_d64;
+        case DISK_IMAGE_TYPE_D67:
+            return &geometry_d67;
         case DISK_IMAGE_TYPE_D71:
-            /* FIXME: what about 40 track D71s? */
-            if (track > 35) {
-                track -= 35;
-            }
-            return (track < 31) + (track < 25) + (track < 18);
+            return &geometry_d71;
         case DISK_IMAGE_TYPE_G71:
-            /* FIXME: is this correct? */
-            if (track > 42) {
-                track -= 42;
-            }
-            return (track < 31) + (track < 25) + (track < 18);
-
+            return &geometry_g71;
+        case DISK_IMAGE_TYPE_D80:
+            return &geometry_d80;
+        case DISK_IMAGE_TYPE_D82:
+            return &geometry_d82;
         default:
-            log_message(disk_image_log,
-                        "Unknown disk type %u. Cannot calculate zone speed",
-                        format);
-            break;
+            return NULL;
     }
-    return 0;
 }
 
 /*-----------------------------------------------------------------------*/
-/* Number of sectors per track */
-
-/** \brief  Sectors per speed zone for D64/D71 images
- */
-static const unsigned int sector_map_d64[SPEED_ZONE_COUNT] = {
-    17, /* tracks 31-[35-40], 66-70 (D71 only) */
-    18, /* track 25-30, 60-65 (D71 only) */
-    19, /* tracks 18-24, 53-59 (D71 only)  */
-    21  /* tracks 1-17, 36-52 (D71 only) */
-};
-
+/* Speed zones */
 
-/** \brief  Sectors per speed zone for D67 images
+/** \brief  Determine the speed zone for \a track in \a format
+ *
+ * The speed zone determines the number of sectors containing in a track for
+ * a given image type. Speed zone 0 is closest to the disk center (containing
+ * the smallest number of sectors for a speed zone), 3 is farthest away
+ * (containing the largest number of sectors for a speed zone).
+ *
+ * \param[in]   format  disk image type enumerator
+ * \param[in]   track   track number
+ *
+ * \return  speed zone (0-3)
  */
-/* the 2040 tried to squeeze one more sector into speed zone 2 */
-static const unsigned int sector_map_d67[SPEED_ZONE_COUNT] = {
-    17, /* tracks 31-[35-40} */
-    18, /* track 25-30 */
-    20, /* tracks 18-24 */
-    21  /* tracks 1-17 */
-};
+unsigned int disk_image_speed_map(unsigned int format, unsigned int track)
+{
+    const disk_image_geometry_t *geo = disk_image_geometry(format);
 
+    if (geo == NULL) {
+        log_message(disk_image_log,
+                    "Unknown disk type %u. Cannot calculate zone speed",
+                    format);
+        return 0;
+    }
 
-/** \brief  Sectors per speed zone for D80/D82 images
- */
-static const unsigned int sector_map_d80[SPEED_ZONE_COUNT] = {
-    23, /* tracks 65-77, 142-154 (D82 only) */
-    25, /* tracks 54-64, 131,141 (D82 only) */
-    27, /* tracks 40-53, 117-130 (D82 only) */
-    29  /* tracks 1-39, 78-116 (D82 only) */
-};
+    /* tracks beyond the table are in the innermost zone */
+    return geo->zone[track > geo->tracks ? geo->tracks : track];
+}
 
+/*-----------------------------------------------------------------------*/
+/* Number of sectors per track */
 
 /** \brief  Get number of sectors for \a track in \a format
  *
@@ -167,27 +393,16 @@ static const unsigned int sector_map_d80[SPEED_ZONE_COUNT] = {
 unsigned int disk_image_sector_per_track(unsigned int format,
                                          unsigned int track)
 {
-    switch (format) {
-        case DISK_IMAGE_TYPE_D64:
-#ifdef HAVE_X64_IMAGE
-        case DISK_IMAGE_TYPE_X64:
-#endif
-        case DISK_IMAGE_TYPE_G64:
-        case DISK_IMAGE_TYPE_P64:
-        case DISK_IMAGE_TYPE_D71:
-        case DISK_IMAGE_TYPE_G71:
-            return sector_map_d64[disk_image_speed_map(format, track)];
-        case DISK_IMAGE_TYPE_D67:
-            return sector_map_d67[disk_image_speed_map(format, track)];
-        case DISK_IMAGE_TYPE_D80:
-        case DISK_IMAGE_TYPE_D82:
-            return sector_map_d80[disk_image_speed_map(format, track)];
-        default:
-            log_message(disk_image_log,
-                        "Unknown disk type %u.  Cannot calculate sectors per track",
-                        format);
+    const disk_image_geometry_t *geo = disk_image_geometry(format);
+
+    if (geo == NULL) {
+        log_message(disk_image_log,
+                    "Unknown disk type %u.  Cannot calculate sectors per track",
+                    format);
+        return 0;
     }
-    return 0;
+
+    return geo->sectors[track > geo->tracks ? geo->tracks : track];
 }
 
 /*-----------------------------------------------------------------------*/
@@ -480,6 +695,28 @@ void disk_image_fsimage_name_set(disk_image_t *image, const char *name)
 }
 
 
+/** \brief  Select whether the image is loaded into memory when opened
+ *
+ * \param[in,out]   image   disk image (not yet opened)
+ * \param[in]       enable  serve all accesses from an in-memory copy
+ */
+void disk_image_fsimage_ram_mode_set(disk_image_t *image, int enable)
+{
+    fsimage_ram_mode_set(image, enable);
+}
+
+
+/** \brief  Select a delta file receiving all writes to the image
+ *
+ * \param[in,out]   image   disk image (not yet opened)
+ * \param[in]       name    delta file name, NULL to write to the image
+ */
+void disk_image_fsimage_overlay_name_set(disk_image_t *image, const char *name)
+{
+    fsimage_overlay_name_set(image, name);
+}
+
+
 /** \brief  Get disk image name
  *
  * \param[in]   image   disk image
@@ -683,6 +920,40 @@ int disk_image_read_sector(const disk_image_t *image, uint8_t *buf, const disk_a
     return rc;
 }
 
+/** \brief  Read a list of sectors
+ *
+ * Like disk_image_read_sector() for every entry of \a list, but physically
+ * consecutive sectors are fetched with a single read where possible.
+ *
+ * \param[in]   list    sector addresses
+ * \param[in]   n       number of sectors in \a list
+ * \param[out]  bufs    \a n buffers of 256 bytes each
+ * \param[out]  errs    \a n result codes, same as disk_image_read_sector()
+ *
+ * \return 0 if all sectors were read without error, -1 otherwise
+ */
+int disk_image_read_sectors(const disk_image_t *image, const disk_addr_t *list, unsigned int n,
+                            uint8_t **bufs, int *errs)
+{
+    unsigned int i;
+    int rc = 0;
+
+    switch (image->device) {
+        case DISK_IMAGE_DEVICE_FS:
+            rc = fsimage_read_sectors(image, list, n, bufs, errs);
+            break;
+        default:
+            for (i = 0; i < n; i++) {
+                errs[i] = disk_image_read_sector(image, bufs[i], &list[i]);
+                if (errs[i] != 0) {
+                    rc = -1;
+                }
+            }
+    }
+
+    return rc;
+}
+
 int disk_image_write_sector(disk_image_t *image, const uint8_t *buf, const disk_addr_t *dadr)
 {
     int rc = 0;
@@ -723,6 +994,11 @@ int disk_image_write_half_track(disk_image_t *image, unsigned int half_track,
         return -1;
     }
 
+    /* cached sectors must not shadow the rewritten track */
+    if (fsimage_flush(image, 1) < 0) {
+        return -1;
+    }
+
     switch (image->type) {
         case DISK_IMAGE_TYPE_P64:
             return fsimage_p64_write_half_track(image, half_track, raw);
@@ -734,8 +1010,13 @@ int disk_image_write_half_track(disk_image_t *image, unsigned int half_track,
     }
 }
 
-int disk_image_read_image(const disk_image_t *image)
+int disk_image_read_image(disk_image_t *image)
 {
+    /* pending sectors must be in the image before it is read back */
+    if (fsimage_flush(image, 0) < 0) {
+        return -1;
+    }
+
     switch (image->type) {
         case DISK_IMAGE_TYPE_P64:
             return fsimage_read_p64_image(image);
@@ -747,6 +1028,58 @@ int disk_image_read_image(const disk_image_t *image)
     }
 }
 
+/*-----------------------------------------------------------------------*/
+
+/** \brief  Write back cached sectors and flush the image file
+ *
+ * \return 0 on success, -1 on error
+ */
+int disk_image_flush(disk_image_t *image)
+{
+    if (image == NULL) {
+        return 0;
+    }
+
+    switch (image->device) {
+        case DISK_IMAGE_DEVICE_FS:
+            return fsimage_flush(image, 0);
+        default:
+            return 0;
+    }
+}
+
+/** \brief  Write back cached data whose flush interval has passed
+ *
+ * \return 0 on success, -1 on error
+ */
+int disk_image_poll(disk_image_t *image)
+{
+    if (image == NULL) {
+        return 0;
+    }
+
+    switch (image->device) {
+        case DISK_IMAGE_DEVICE_FS:
+            return fsimage_poll(image);
+        default:
+            return 0;
+    }
+}
+
+/** \brief  Configure the write-back sector cache of an open image
+ *
+ * \param[in]  size        number of cached sectors, 0 disables the cache
+ * \param[in]  max_dirty   number of dirty sectors that triggers a flush
+ * \param[in]  interval    maximum age of unwritten data in ms (0 = no limit)
+ */
+void disk_image_set_write_cache(disk_image_t *image, unsigned int size,
+                                unsigned int max_dirty, uint32_t interval)
+{
+    if (image != NULL && image->device == DISK_IMAGE_DEVICE_FS) {
+        fsimage_set_write_cache(image, size, max_dirty, interval);
+    }
+}
+
 int disk_image_write_p64_image(const disk_image_t *image)
 {
     return fsimage_write_p64_image(image);
@@ -104,6 +104,17 @@ struct disk_image_s {
 };
 typedef struct disk_image_s disk_image_t;
 
+/** \brief  Precomputed geometry of a zoned disk format
+ *
+ * All tables are indexed by track number (1 to \a tracks).
+ */
+typedef struct disk_image_geometry_s {
+    unsigned int tracks;        /**< highest track covered by the tables */
+    const uint8_t *zone;        /**< speed zone of each track */
+    const uint8_t *sectors;     /**< number of sectors of each track */
+    const uint16_t *offset;     /**< offset in sectors of each track */
+} disk_image_geometry_t;
+
 struct disk_addr_s {
     unsigned int track;
     unsigned int sector;
@@ -116,6 +127,8 @@ int disk_image_cmdline_options_init(void);
 void disk_image_resources_shutdown(void);
 
 void disk_image_fsimage_name_set(disk_image_t *image, const char *name);
+void disk_image_fsimage_ram_mode_set(disk_image_t *image, int enable);
+void disk_image_fsimage_overlay_name_set(disk_image_t *image, const char *name);
 const char *disk_image_fsimage_name_get(const disk_image_t *image);
 ADFILE *disk_image_fsimage_fd_get(const disk_image_t *image);
 int disk_image_fsimage_create(const char *name, unsigned int type);
@@ -140,17 +153,25 @@ int disk_image_close(disk_image_t *image);
 int disk_image_read_sector_id(const disk_image_t *image, uint8_t *buf, const disk_addr_t *dadr);
 int disk_image_read_sector(const disk_image_t *image, uint8_t *buf, const disk_addr_t *dadr);
 int disk_image_write_sector(disk_image_t *image, const uint8_t *buf, const disk_addr_t *dadr);
+int disk_image_read_sectors(const disk_image_t *image, const disk_addr_t *list, unsigned int n,
+                            uint8_t **bufs, int *errs);
 int disk_image_check_sector(const disk_image_t *image, unsigned int track, unsigned int sector);
 unsigned int disk_image_sector_per_track(unsigned int format, unsigned int track);
+const disk_image_geometry_t *disk_image_geometry(unsigned int format);
 unsigned int disk_image_raw_track_size(unsigned int format, unsigned int track);
 unsigned int disk_image_gap_size(unsigned int format, unsigned int track);
 unsigned int disk_image_header_gap_size(unsigned int format, unsigned int track);
 unsigned int disk_image_sync_size(unsigned int format, unsigned int track);
 
-int disk_image_read_image(const disk_image_t *image);
+int disk_image_read_image(disk_image_t *image);
 int disk_image_write_p64_image(const disk_image_t *image);
 int disk_image_write_half_track(disk_image_t *image, unsigned int half_track, const struct disk_track_s *raw);
 
+int disk_image_flush(disk_image_t *image);
+int disk_image_poll(disk_image_t *image);
+void disk_image_set_write_cache(disk_image_t *image, unsigned int size,
+                                unsigned int max_dirty, uint32_t interval);
+
 unsigned int disk_image_speed_map(unsigned int format, unsigned int track);
 
 void disk_image_attach_log(const disk_image_t *image, signed int lognum, unsigned int unit, unsigned int drive);
@@ -0,0 +1,236 @@
+/** \file   fsimage-cache.c
+ *
+ * \brief   Write-back sector cache for file system images
+ *
+ * Sectors written to an image are collected here and handed back to the
+ * image backend in track/sector order when the cache is flushed.  Written
+ * sectors stay in the cache (clean) after a flush so re-reading them does
+ * not touch the image until they are evicted.
+ *
+ * This file is part of VICE, the Versatile Commodore Emulator.
+ * See README for copyright notice.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ *  02111-1307  USA.
+ *
+ */
+
+#include <string.h>
+
+#include "archdep.h"
+#include "diskimage.h"
+#include "fsimage-cache.h"
+#include "lib.h"
+#include "types.h"
+
+#define CACHE_ENTRY_FREE   0
+#define CACHE_ENTRY_CLEAN  1
+#define CACHE_ENTRY_DIRTY  2
+
+typedef struct fsimage_cache_entry_s {
+    unsigned int track;
+    unsigned int sector;
+    unsigned int state;
+    uint32_t used;          /* LRU stamp */
+    uint8_t data[256];
+} fsimage_cache_entry_t;
+
+struct fsimage_cache_s {
+    fsimage_cache_entry_t *entries;   /* allocated on first write */
+    unsigned int size;
+    unsigned int max_dirty;
+    unsigned int num_dirty;
+    uint32_t interval;
+    uint32_t dirty_since;   /* archdep_ticks_ms() of the oldest dirty entry */
+    uint32_t clock;
+};
+
+
+fsimage_cache_t *fsimage_cache_create(unsigned int size, unsigned int max_dirty,
+                                      uint32_t interval)
+{
+    fsimage_cache_t *cache;
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    cache = lib_calloc(1, sizeof(fsimage_cache_t));
+    cache->size = size;
+    cache->max_dirty = (max_dirty == 0 || max_dirty > size) ? size : max_dirty;
+    cache->interval = interval;
+
+    return cache;
+}
+
+void fsimage_cache_destroy(fsimage_cache_t *cache)
+{
+    if (cache != NULL) {
+        lib_free(cache->entries);
+        lib_free(cache);
+    }
+}
+
+static fsimage_cache_entry_t *fsimage_cache_find(fsimage_cache_t *cache,
+                                                 const disk_addr_t *dadr)
+{
+    unsigned int i;
+
+    if (cache->entries == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < cache->size; i++) {
+        fsimage_cache_entry_t *e = &cache->entries[i];
+        if (e->state != CACHE_ENTRY_FREE
+            && e->track == dadr->track && e->sector == dadr->sector) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/** \brief  Look up a sector in the cache
+ *
+ * \return  0 if the sector was found and copied to \a buf, -1 otherwise
+ */
+int fsimage_cache_read(fsimage_cache_t *cache, uint8_t *buf,
+                       const disk_addr_t *dadr)
+{
+    fsimage_cache_entry_t *e = fsimage_cache_find(cache, dadr);
+
+    if (e == NULL) {
+        return -1;
+    }
+
+    e->used = ++cache->clock;
+    memcpy(buf, e->data, 256);
+    return 0;
+}
+
+/** \brief  Store a sector in the cache and mark it dirty
+ *
+ * \return  0 on success, -1 if every slot holds unwritten data (the cache
+ *          must be flushed before trying again)
+ */
+int fsimage_cache_write(fsimage_cache_t *cache, const uint8_t *buf,
+                        const disk_addr_t *dadr)
+{
+    fsimage_cache_entry_t *e;
+    unsigned int i;
+
+    if (cache->entries == NULL) {
+        cache->entries = lib_calloc(cache->size, sizeof(fsimage_cache_entry_t));
+    }
+
+    e = fsimage_cache_find(cache, dadr);
+    if (e == NULL) {
+        /* take a free slot or evict the least recently used clean one */
+        for (i = 0; i < cache->size; i++) {
+            fsimage_cache_entry_t *c = &cache->entries[i];
+            if (c->state == CACHE_ENTRY_FREE) {
+                e = c;
+                break;
+            }
+            if (c->state == CACHE_ENTRY_CLEAN && (e == NULL || c->used < e->used)) {
+                e = c;
+            }
+        }
+        if (e == NULL) {
+            return -1;
+        }
+        e->track = dadr->track;
+        e->sector = dadr->sector;
+        e->state = CACHE_ENTRY_CLEAN;
+    }
+
+    if (e->state != CACHE_ENTRY_DIRTY) {
+        if (cache->num_dirty == 0) {
+            cache->dirty_since = archdep_ticks_ms();
+        }
+        cache->num_dirty++;
+        e->state = CACHE_ENTRY_DIRTY;
+    }
+
+    e->used = ++cache->clock;
+    memcpy(e->data, buf, 256);
+    return 0;
+}
+
+/** \brief  Check whether the cache should be written back
+ *
+ * \return  non-zero if the dirty threshold or the flush interval is exceeded
+ */
+int fsimage_cache_flush_due(const fsimage_cache_t *cache)
+{
+    if (cache->num_dirty == 0) {
+        return 0;
+    }
+    if (cache->num_dirty >= cache->max_dirty) {
+        return 1;
+    }
+    return cache->interval != 0
+           && (uint32_t)(archdep_ticks_ms() - cache->dirty_since) >= cache->interval;
+}
+
+/** \brief  Get the next dirty sector to write back
+ *
+ * Dirty sectors are returned in ascending track/sector order and are marked
+ * clean as they are handed out.
+ *
+ * \param[out]  dadr    address of the returned sector
+ *
+ * \return  sector data (valid until the next cache write) or NULL if no
+ *          dirty sectors are left
+ */
+const uint8_t *fsimage_cache_next_dirty(fsimage_cache_t *cache, disk_addr_t *dadr)
+{
+    fsimage_cache_entry_t *e = NULL;
+    unsigned int i;
+
+    if (cache->num_dirty == 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < cache->size; i++) {
+        fsimage_cache_entry_t *c = &cache->entries[i];
+        if (c->state == CACHE_ENTRY_DIRTY
+            && (e == NULL || c->track < e->track
+                || (c->track == e->track && c->sector < e->sector))) {
+            e = c;
+        }
+    }
+
+    e->state = CACHE_ENTRY_CLEAN;
+    cache->num_dirty--;
+    dadr->track = e->track;
+    dadr->sector = e->sector;
+    return e->data;
+}
+
+/** \brief  Drop all cached sectors, including unwritten ones
+ */
+void fsimage_cache_invalidate(fsimage_cache_t *cache)
+{
+    unsigned int i;
+
+    if (cache->entries != NULL) {
+        for (i = 0; i < cache->size; i++) {
+            cache->entries[i].state = CACHE_ENTRY_FREE;
+        }
+    }
+    cache->num_dirty = 0;
+}
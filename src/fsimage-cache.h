@@ -0,0 +1,65 @@
+/** \file   fsimage-cache.h
+ *
+ * \brief   Write-back sector cache for file system images - header
+ *
+ * This file is part of VICE, the Versatile Commodore Emulator.
+ * See README for copyright notice.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ *  02111-1307  USA.
+ *
+ */
+
+#ifndef VICE_FSIMAGE_CACHE_H
+#define VICE_FSIMAGE_CACHE_H
+
+#include "types.h"
+
+/** \brief  Default number of sectors held by the write cache
+ */
+#ifndef FSIMAGE_CACHE_DEFAULT_SIZE
+#define FSIMAGE_CACHE_DEFAULT_SIZE      32
+#endif
+
+/** \brief  Default number of dirty sectors that triggers a flush
+ */
+#ifndef FSIMAGE_CACHE_DEFAULT_MAX_DIRTY
+#define FSIMAGE_CACHE_DEFAULT_MAX_DIRTY 24
+#endif
+
+/** \brief  Default maximum age (in ms) of unwritten data, 0 = no limit
+ */
+#ifndef FSIMAGE_CACHE_DEFAULT_INTERVAL
+#define FSIMAGE_CACHE_DEFAULT_INTERVAL  2000
+#endif
+
+struct disk_addr_s;
+
+typedef struct fsimage_cache_s fsimage_cache_t;
+
+fsimage_cache_t *fsimage_cache_create(unsigned int size, unsigned int max_dirty,
+                                      uint32_t interval);
+void fsimage_cache_destroy(fsimage_cache_t *cache);
+
+int fsimage_cache_read(fsimage_cache_t *cache, uint8_t *buf,
+                       const struct disk_addr_s *dadr);
+int fsimage_cache_write(fsimage_cache_t *cache, const uint8_t *buf,
+                        const struct disk_addr_s *dadr);
+int fsimage_cache_flush_due(const fsimage_cache_t *cache);
+const uint8_t *fsimage_cache_next_dirty(fsimage_cache_t *cache,
+                                        struct disk_addr_s *dadr);
+void fsimage_cache_invalidate(fsimage_cache_t *cache);
+
+#endif
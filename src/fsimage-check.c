@@ -32,6 +32,19 @@
 #include "fsimage-check.h"
 
 
+/* offset of a sector on a zoned format, track must be within the tables */
+static int fsimage_check_zoned(unsigned int format, unsigned int track,
+                               unsigned int sector)
+{
+    const disk_image_geometry_t *geo = disk_image_geometry(format);
+
+    if (sector >= geo->sectors[track]) {
+        return FSIMAGE_BAD_SECNUM;
+    }
+    return geo->offset[track] + sector;
+}
+
+
 /** \brief  Check if (\a track, \a sector) is valid for \a image
  *
  * Check if \a sector is a valid sector number for \a track in \a image. This
@@ -48,7 +61,7 @@
 int fsimage_check_sector(const disk_image_t *image, unsigned int track,
                          unsigned int sector)
 {
-    unsigned int sectors = 0, i;
+    unsigned int sectors = 0;
 
     if (image->type != DISK_IMAGE_TYPE_D90 && track < 1) {
         return FSIMAGE_BAD_TRKNUM;
@@ -62,42 +75,17 @@ int fsimage_check_sector(const disk_image_t *image, unsigned int track,
             if (track > MAX_TRACKS_1541) {
                return FSIMAGE_BAD_TRKNUM;
             }
-            if (sector >= disk_image_sector_per_track(DISK_IMAGE_TYPE_D64, track)) {
-                return FSIMAGE_BAD_SECNUM;
-            }
-            for (i = 1; i < track; i++) {
-                sectors += disk_image_sector_per_track(DISK_IMAGE_TYPE_D64, i);
-            }
-            sectors += sector;
-            break;
+            return fsimage_check_zoned(DISK_IMAGE_TYPE_D64, track, sector);
         case DISK_IMAGE_TYPE_D67:
             if (track > MAX_TRACKS_2040) {
                return FSIMAGE_BAD_TRKNUM;
             }
-            if (sector >= disk_image_sector_per_track(DISK_IMAGE_TYPE_D67, track)) {
-                return FSIMAGE_BAD_SECNUM;
-            }
-            for (i = 1; i < track; i++) {
-                sectors += disk_image_sector_per_track(DISK_IMAGE_TYPE_D67, i);
-            }
-            sectors += sector;
-            break;
+            return fsimage_check_zoned(DISK_IMAGE_TYPE_D67, track, sector);
         case DISK_IMAGE_TYPE_D71:
             if (track > MAX_TRACKS_1571) {
                 return FSIMAGE_BAD_TRKNUM;
             }
-            if (track > NUM_TRACKS_1541) {      /* The second side */
-                track -= NUM_TRACKS_1541;
-                sectors = NUM_BLOCKS_1541;
-            }
-            if (sector >= disk_image_sector_per_track(DISK_IMAGE_TYPE_D64, track)) {
-                return FSIMAGE_BAD_SECNUM;
-            }
-            for (i = 1; i < track; i++) {
-                sectors += disk_image_sector_per_track(DISK_IMAGE_TYPE_D64, i);
-            }
-            sectors += sector;
-            break;
+            return fsimage_check_zoned(DISK_IMAGE_TYPE_D71, track, sector);
         case DISK_IMAGE_TYPE_D81:
             if (track > MAX_TRACKS_1581) {
                return FSIMAGE_BAD_TRKNUM;
@@ -111,44 +99,19 @@ int fsimage_check_sector(const disk_image_t *image, unsigned int track,
             if (track > MAX_TRACKS_8050) {
                return FSIMAGE_BAD_TRKNUM;
             }
-            if (sector >= disk_image_sector_per_track(DISK_IMAGE_TYPE_D80, track)) {
-                return FSIMAGE_BAD_SECNUM;
-            }
-            for (i = 1; i < track; i++) {
-                sectors += disk_image_sector_per_track(DISK_IMAGE_TYPE_D80, i);
-            }
-            sectors += sector;
-            break;
+            return fsimage_check_zoned(DISK_IMAGE_TYPE_D80, track, sector);
         case DISK_IMAGE_TYPE_D82:
             if (track > MAX_TRACKS_8250) {
                 return FSIMAGE_BAD_TRKNUM;
             }
-            if (track > NUM_TRACKS_8050) {      /* The second side */
-                track -= NUM_TRACKS_8050;
-                sectors = NUM_BLOCKS_8050;
-            }
-            if (sector >= disk_image_sector_per_track(DISK_IMAGE_TYPE_D80, track)) {
-                return FSIMAGE_BAD_SECNUM;
-            }
-            for (i = 1; i < track; i++) {
-                sectors += disk_image_sector_per_track(DISK_IMAGE_TYPE_D80, i);
-            }
-            sectors += sector;
-            break;
+            return fsimage_check_zoned(DISK_IMAGE_TYPE_D82, track, sector);
         case DISK_IMAGE_TYPE_G64:
         case DISK_IMAGE_TYPE_G71: /* FIXME: does this handle the second side correctly? */
         case DISK_IMAGE_TYPE_P64:
             if (track > image->tracks || track > MAX_TRACKS_1541) {
                return FSIMAGE_BAD_TRKNUM;
             }
-            if (sector >= disk_image_sector_per_track(DISK_IMAGE_TYPE_D64, track)) {
-                return FSIMAGE_BAD_SECNUM;
-            }
-            for (i = 1; i < track; i++) {
-                sectors += disk_image_sector_per_track(DISK_IMAGE_TYPE_D64, i);
-            }
-            sectors += sector;
-            break;
+            return fsimage_check_zoned(DISK_IMAGE_TYPE_D64, track, sector);
         case DISK_IMAGE_TYPE_D1M:
             if (track > NUM_TRACKS_1000) {
                return FSIMAGE_BAD_TRKNUM;
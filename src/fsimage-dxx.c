@@ -63,7 +63,14 @@ int fsimage_dxx_write_half_track(disk_image_t *image, unsigned int half_track,
     if (track > image->tracks) {
         if (fsimage->error_info.map) {
             int newlen = sectors + max_sector;
-            fsimage->error_info.map = lib_realloc(fsimage->error_info.map, newlen);
+            if (fsimage_error_info_in_mem(fsimage)) {
+                /* the map lives inside the loaded image, take a copy to grow */
+                uint8_t *map = lib_malloc(newlen);
+                memcpy(map, fsimage->error_info.map, fsimage->error_info.len);
+                fsimage->error_info.map = map;
+            } else {
+                fsimage->error_info.map = lib_realloc(fsimage->error_info.map, newlen);
+            }
             memset(fsimage->error_info.map + fsimage->error_info.len, 0,
                    newlen - fsimage->error_info.len);
             fsimage->error_info.len = newlen;
@@ -105,7 +112,7 @@ int fsimage_dxx_write_half_track(disk_image_t *image, unsigned int half_track,
         offset += X64_HEADER_LENGTH;
     }
 #endif
-    if (util_fpwrite(fsimage->fd, buffer, max_sector * 256, offset) < 0) {
+    if (fsimage_pwrite(fsimage, buffer, max_sector * 256, offset) < 0) {
         log_error(fsimage_dxx_log, "Error writing T:%u to disk image.",
                   track);
         lib_free(buffer);
@@ -123,10 +130,10 @@ int fsimage_dxx_write_half_track(disk_image_t *image, unsigned int half_track,
 #endif
             fsimage->error_info.dirty = 0;
             if (error_info_created) {
-                res = util_fpwrite(fsimage->fd, fsimage->error_info.map,
+                res = fsimage_pwrite(fsimage, fsimage->error_info.map,
                                    fsimage->error_info.len, fsimage->error_info.len * 256);
             } else {
-                res = util_fpwrite(fsimage->fd, fsimage->error_info.map + sectors,
+                res = fsimage_pwrite(fsimage, fsimage->error_info.map + sectors,
                                    max_sector, offset);
             }
             if (res < 0) {
@@ -172,13 +179,18 @@ int fsimage_read_dxx_image(const disk_image_t *image)
 
     bam_id[0] = bam_id[1] = 0xa0;
     if (sectors >= 0) {
-        util_fpread(fsimage->fd, buffer, 256, sectors << 8);
+        fsimage_pread(fsimage, buffer, 256, sectors << 8);
     } else {
         return -1;
     }
     header.id1 = bam_id[0];
     header.id2 = bam_id[1];
 
+    /* all tracks are rebuilt below */
+    for (half_track = 0; half_track < MAX_GCR_TRACKS; half_track++) {
+        gcr_invalidate_index(&image->gcr->tracks[half_track]);
+    }
+
     /* check double sided images */
     image_has_two_single_sides = (image->type == DISK_IMAGE_TYPE_D71) && !(buffer[0x03] & 0x80);
 #if 1
@@ -244,7 +256,7 @@ int fsimage_read_dxx_image(const disk_image_t *image)
 
                 buffer[BAM_ID_1571] = buffer[BAM_ID_1571 + 1] = 0xa0;
                 if (sectors >= 0) {
-                    util_fpread(fsimage->fd, buffer, 256, sectors << 8);
+                    fsimage_pread(fsimage, buffer, 256, sectors << 8);
                 }
                 header.id1 = buffer[BAM_ID_1571]; /* second side, update id and track */
                 header.id2 = buffer[BAM_ID_1571 + 1];
@@ -271,7 +283,7 @@ int fsimage_read_dxx_image(const disk_image_t *image)
 #endif
                 if (sectors >= 0) {
                     rf = CBMDOS_FDC_ERR_DRIVE;
-                    if (util_fpread(fsimage->fd, buffer, 256, offset) >= 0) {
+                    if (fsimage_pread(fsimage, buffer, 256, offset) >= 0) {
                         if (fsimage->error_info.map != NULL) {
                             rf = fsimage->error_info.map[sectors];
                         }
@@ -374,7 +386,7 @@ int fsimage_dxx_read_sector(const disk_image_t *image, uint8_t *buf, const disk_
 
     if (harderror == 0) {
         if (image->gcr == NULL) {
-            if (util_fpread(fsimage->fd, buf, 256, offset) < 0) {
+            if (fsimage_pread(fsimage, buf, 256, offset) < 0) {
                 log_error(fsimage_dxx_log,
                         "Error reading T:%u S:%u from disk image.",
                         dadr->track, dadr->sector);
@@ -429,6 +441,124 @@ int fsimage_dxx_read_sector(const disk_image_t *image, uint8_t *buf, const disk_
     }
 }
 
+/* sectors flagged in the error map need the full single sector logic */
+static int fsimage_dxx_plain_sector(const fsimage_t *fsimage, int sectors)
+{
+    return sectors >= 0
+           && (fsimage->error_info.map == NULL
+               || fsimage->error_info.map[sectors] <= CBMDOS_FDC_ERR_OK);
+}
+
+int fsimage_dxx_read_sectors(const disk_image_t *image, const disk_addr_t *list,
+                             unsigned int n, uint8_t **bufs, int *errs)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    unsigned int i, j, k;
+    int sectors;
+    long offset;
+    int rc = 0;
+
+    for (i = 0; i < n; i = j) {
+        sectors = disk_image_check_sector(image, list[i].track, list[i].sector);
+
+        if (image->gcr != NULL || !fsimage_dxx_plain_sector(fsimage, sectors)) {
+            errs[i] = fsimage_dxx_read_sector(image, bufs[i], &list[i]);
+            j = i + 1;
+        } else {
+            /* merge the run of sectors that follow each other in the file */
+            for (j = i + 1; j < n; j++) {
+                int next = disk_image_check_sector(image, list[j].track, list[j].sector);
+                if (next != sectors + (int)(j - i) || !fsimage_dxx_plain_sector(fsimage, next)) {
+                    break;
+                }
+            }
+
+            offset = sectors * 256;
+#ifdef HAVE_X64_IMAGE
+            if (image->type == DISK_IMAGE_TYPE_X64) {
+                offset += X64_HEADER_LENGTH;
+            }
+#endif
+            if (fsimage_preadv(fsimage, &bufs[i], 256, j - i, offset) < 0) {
+                log_error(fsimage_dxx_log,
+                          "Error reading %u sectors from T:%u S:%u of disk image.",
+                          j - i, list[i].track, list[i].sector);
+                for (k = i; k < j; k++) {
+                    errs[k] = -1;
+                }
+            } else {
+                for (k = i; k < j; k++) {
+                    errs[k] = CBMDOS_IPE_OK;
+                }
+            }
+        }
+
+        for (k = i; k < j; k++) {
+            if (errs[k] != CBMDOS_IPE_OK) {
+                rc = -1;
+            }
+        }
+    }
+
+    return rc;
+}
+
+typedef struct fsimage_dxx_write_s {
+    fsimage_t *fsimage;
+    uint8_t data[256];
+} fsimage_dxx_write_t;
+
+/* completion of fsimage_dxx_write_sector_async(), may run in the I/O worker */
+static void fsimage_dxx_write_done(void *param, size_t count)
+{
+    fsimage_dxx_write_t *w = param;
+
+    if (count != 1) {
+        w->fsimage->io_error = 1;
+    }
+    lib_free(w);
+}
+
+/* Queue a sector write with the archdep I/O worker and return without
+   waiting for it. Failures are recorded in fsimage->io_error. Returns -1 if
+   the sector needs fsimage_dxx_write_sector() (memory mapped, overlay or GCR
+   image, error info to update) */
+int fsimage_dxx_write_sector_async(disk_image_t *image, const uint8_t *buf, const disk_addr_t *dadr)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    fsimage_dxx_write_t *w;
+    int sectors;
+    long offset;
+
+    if (fsimage->mem.data != NULL || fsimage->overlay != NULL || image->gcr != NULL) {
+        return -1;
+    }
+
+    sectors = disk_image_check_sector(image, dadr->track, dadr->sector);
+    if (sectors < 0
+        || (fsimage->error_info.map != NULL
+            && fsimage->error_info.map[sectors] != CBMDOS_FDC_ERR_OK)) {
+        return -1;
+    }
+
+    offset = sectors * 256;
+#ifdef HAVE_X64_IMAGE
+    if (image->type == DISK_IMAGE_TYPE_X64) {
+        offset += X64_HEADER_LENGTH;
+    }
+#endif
+
+    w = lib_malloc(sizeof(fsimage_dxx_write_t));
+    w->fsimage = fsimage;
+    memcpy(w->data, buf, 256);
+    if (archdep_awrite(w->data, 256, 1, offset, fsimage->fd, fsimage_dxx_write_done, w) < 0) {
+        lib_free(w);
+        return -1;
+    }
+
+    return 0;
+}
+
 int fsimage_dxx_write_sector(disk_image_t *image, const uint8_t *buf, const disk_addr_t *dadr)
 {
     int sectors;
@@ -451,7 +581,7 @@ int fsimage_dxx_write_sector(disk_image_t *image, const uint8_t *buf, const disk
         offset += X64_HEADER_LENGTH;
     }
 #endif
-    if (util_fpwrite(fsimage->fd, buf, 256, offset) < 0) {
+    if (fsimage_pwrite(fsimage, buf, 256, offset) < 0) {
         log_error(fsimage_dxx_log, "Error writing T:%u S:%u to disk image.",
                   dadr->track, dadr->sector);
         return -1;
@@ -470,15 +600,14 @@ int fsimage_dxx_write_sector(disk_image_t *image, const uint8_t *buf, const disk
         }
 #endif
         fsimage->error_info.map[sectors] = CBMDOS_FDC_ERR_OK;
-        if (util_fpwrite(fsimage->fd, &fsimage->error_info.map[sectors], 1, offset) < 0) {
+        if (fsimage_pwrite(fsimage, &fsimage->error_info.map[sectors], 1, offset) < 0) {
             log_error(fsimage_dxx_log,
                     "Error writing T:%u S:%u error info to disk image.",
                     dadr->track, dadr->sector);
         }
     }
 
-    /* Make sure the stream is visible to other readers.  */
-    archdep_fflush(fsimage->fd);
+    /* The stream is flushed by fsimage_flush(), not after every sector.  */
     return 0;
 }
 
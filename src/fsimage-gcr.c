@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "archdep.h"
 #include "diskconstants.h"
 #include "diskimage.h"
 #include "fsimage-gcr.h"
@@ -54,11 +55,7 @@ int fsimage_read_gcr_image(const disk_image_t *image)
 
     for (half_track = 0; half_track < MAX_GCR_TRACKS; half_track++) {
         /* free existing track */
-        if (image->gcr->tracks[half_track].data) {
-            lib_free(image->gcr->tracks[half_track].data);
-            image->gcr->tracks[half_track].data = NULL;
-            image->gcr->tracks[half_track].size = 0;
-        }
+        gcr_free_track(&image->gcr->tracks[half_track]);
         /* load new track from image */
         if (half_track < image->max_half_tracks) {
             fsimage_gcr_read_half_track(image, half_track + 2, &image->gcr->tracks[half_track]);
@@ -73,18 +70,27 @@ int fsimage_read_gcr_image(const disk_image_t *image)
     return 0;
 }
 /*-----------------------------------------------------------------------*/
-/* Seek to half track */
+/* Header and track tables, parsed once when the image is attached.  */
 
-static long fsimage_gcr_seek_half_track(fsimage_t *fsimage, unsigned int half_track,
-                                        uint16_t *max_track_length, uint8_t *num_half_tracks)
+/** \brief  Read the G64/G71 header and its track offset and speed zone tables
+ *
+ * The tables are kept in the fsimage until it is closed and are updated by
+ * fsimage_gcr_write_half_track() when it extends the image.
+ *
+ * \return 0 on success, -1 on error
+ */
+int fsimage_gcr_read_header(disk_image_t *image)
 {
+    fsimage_t *fsimage = image->media.fsimage;
     uint8_t buf[12];
+    uint8_t *tables;
+    unsigned int num, i;
 
     if ( !archdep_fisopen(fsimage->fd) ) {
         log_error(fsimage_gcr_log, "Attempt to read without disk image.");
         return -1;
     }
-    if (util_fpread(fsimage->fd, buf, 12, 0) < 0) {
+    if (fsimage_pread(fsimage, buf, 12, 0) < 0) {
         log_error(fsimage_gcr_log, "Could not read GCR disk image.");
         return -1;
     }
@@ -94,28 +100,49 @@ static long fsimage_gcr_seek_half_track(fsimage_t *fsimage, unsigned int half_tr
         return -1;
     }
 
-    *num_half_tracks = buf[9];
-    if (*num_half_tracks > MAX_GCR_TRACKS) {
+    num = buf[9];
+    if (num > MAX_GCR_TRACKS) {
         log_error(fsimage_gcr_log, "Too many half tracks." );
         return -1;
     }
 
-    *max_track_length = util_le_buf_to_word(&buf[10]);
-#if 0
-    /* if 0'ed because:
-       *max_track_length is of type WORD and NUM_MAX_MEM_BYTES_TRACK is 65536
-     */
-    if (*max_track_length > NUM_MAX_MEM_BYTES_TRACK) {
-        log_error(fsimage_gcr_log, "Too large max track length.");
+    /* offsets and speed zones, both num entries of 4 bytes */
+    tables = lib_malloc(num * 8);
+    if (fsimage_pread(fsimage, tables, num * 8, 12) < 0) {
+        log_error(fsimage_gcr_log, "Could not read GCR disk image.");
+        lib_free(tables);
         return -1;
     }
-#endif
 
-    if (util_fpread(fsimage->fd, buf, 4, 12 + (half_track - 2) * 4) < 0) {
-        log_error(fsimage_gcr_log, "Could not read GCR disk image.");
+    lib_free(fsimage->gcr.offsets);
+    fsimage->gcr.offsets = lib_malloc(num * 2 * sizeof(uint32_t));
+    fsimage->gcr.speeds = fsimage->gcr.offsets + num;
+    for (i = 0; i < num * 2; i++) {
+        fsimage->gcr.offsets[i] = util_le_buf_to_dword(tables + i * 4);
+    }
+    lib_free(tables);
+
+    fsimage->gcr.num_half_tracks = (uint8_t)num;
+    fsimage->gcr.max_track_length = util_le_buf_to_word(&buf[10]);
+
+    return 0;
+}
+
+/* Look up the offset of a half track, 0 if it is not in the image */
+static long fsimage_gcr_seek_half_track(const disk_image_t *image, unsigned int half_track)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+
+    if (fsimage->gcr.offsets == NULL
+        && fsimage_gcr_read_header((disk_image_t *)image) < 0) {
         return -1;
     }
-    return util_le_buf_to_dword(buf);
+    if (half_track < 2 || half_track - 2 >= fsimage->gcr.num_half_tracks) {
+        log_error(fsimage_gcr_log, "Half track %u out of range.", half_track);
+        return -1;
+    }
+
+    return (long)fsimage->gcr.offsets[half_track - 2];
 }
 
 /*-----------------------------------------------------------------------*/
@@ -128,32 +155,31 @@ int fsimage_gcr_read_half_track(const disk_image_t *image, unsigned int half_tra
     uint8_t buf[4];
     long offset;
     fsimage_t *fsimage;
-    uint16_t max_track_length;
-    uint8_t num_half_tracks;
     unsigned int orig_half_track = half_track;
 
     fsimage = image->media.fsimage;
 
     raw->data = NULL;
     raw->size = 0;
+    raw->index = NULL;
 
     while( raw->data==NULL )
       {
-        offset = fsimage_gcr_seek_half_track(fsimage, half_track, &max_track_length, &num_half_tracks);
+        offset = fsimage_gcr_seek_half_track(image, half_track);
 
         if (offset < 0) {
           return -1;
         }
 
         if (offset != 0) {
-          if (util_fpread(fsimage->fd, buf, 2, offset) < 0) {
+          if (fsimage_pread(fsimage, buf, 2, offset) < 0) {
             log_error(fsimage_gcr_log, "Could not read GCR disk image.");
             return -1;
           }
 
           track_len = util_le_buf_to_word(buf);
 
-          if ((track_len < 1) || (track_len > max_track_length)) {
+          if ((track_len < 1) || (track_len > fsimage->gcr.max_track_length)) {
             log_error(fsimage_gcr_log,
                       "Track field length %u is not supported.",
                       track_len);
@@ -163,7 +189,7 @@ int fsimage_gcr_read_half_track(const disk_image_t *image, unsigned int half_tra
           raw->data = lib_calloc(1, track_len);
           raw->size = track_len;
 
-          if (archdep_fread(raw->data, track_len, 1, fsimage->fd) < 1) {
+          if (fsimage_pread(fsimage, raw->data, track_len, offset + 2) < 0) {
             log_error(fsimage_gcr_log, "Could not read GCR disk image.");
             return -1;
           }
@@ -175,8 +201,7 @@ int fsimage_gcr_read_half_track(const disk_image_t *image, unsigned int half_tra
 
         /* the following can be #if 0'd to skip looking for actual track number */
 #if 1
-        static int current_half_track = -1;
-        if( half_track != current_half_track )
+        if( half_track != fsimage->gcr.checked_half_track )
           {
             uint8_t track;
 
@@ -205,7 +230,7 @@ int fsimage_gcr_read_half_track(const disk_image_t *image, unsigned int half_tra
                 raw->size = 0;
               }
             else
-              current_half_track = half_track;
+              fsimage->gcr.checked_half_track = half_track;
           }
 #endif
       }
@@ -213,33 +238,190 @@ int fsimage_gcr_read_half_track(const disk_image_t *image, unsigned int half_tra
     return 0;
 }
 
-static int fsimage_gcr_read_track(const disk_image_t *image, unsigned int track,
-                                  disk_track_t *raw)
+/*-----------------------------------------------------------------------*/
+/* Resident half tracks, read on first use and kept until the image is
+   closed or, with FSIMAGE_GCR_RESIDENT_TRACKS set, evicted LRU.  Written
+   sectors only modify the resident track, dirty tracks are written to the
+   image by fsimage_gcr_flush_tracks().  */
+
+typedef struct fsimage_gcr_track_s {
+    disk_track_t raw;
+    uint32_t used;
+    int dirty;
+} fsimage_gcr_track_t;
+
+static void fsimage_gcr_drop_half_track(fsimage_t *fsimage, fsimage_gcr_track_t *t)
 {
-    return fsimage_gcr_read_half_track(image, track << 1, raw);
+    if (t->dirty) {
+        t->dirty = 0;
+        fsimage->track_cache.num_dirty--;
+    }
+    if (t->raw.data != NULL) {
+        gcr_invalidate_index(&t->raw);
+        lib_free(t->raw.data);
+        t->raw.data = NULL;
+        t->raw.size = 0;
+        fsimage->track_cache.num--;
+    }
+}
+
+static disk_track_t *fsimage_gcr_get_half_track(const disk_image_t *image,
+                                                unsigned int half_track)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    fsimage_gcr_track_t *t;
+
+    if (half_track < 2 || half_track - 2 >= MAX_GCR_TRACKS) {
+        return NULL;
+    }
+
+    if (fsimage->track_cache.tracks == NULL) {
+        fsimage->track_cache.tracks = lib_calloc(MAX_GCR_TRACKS, sizeof(fsimage_gcr_track_t));
+    }
+
+    t = &fsimage->track_cache.tracks[half_track - 2];
+    if (t->raw.data == NULL) {
+#if FSIMAGE_GCR_RESIDENT_TRACKS > 0
+        if (fsimage->track_cache.num >= FSIMAGE_GCR_RESIDENT_TRACKS) {
+            fsimage_gcr_track_t *lru = NULL;
+            unsigned int i;
+
+            /* dirty tracks are never evicted, if there are only dirty ones
+               the limit is exceeded until the next flush */
+            for (i = 0; i < MAX_GCR_TRACKS; i++) {
+                fsimage_gcr_track_t *c = &fsimage->track_cache.tracks[i];
+                if (c->raw.data != NULL && !c->dirty
+                    && (lru == NULL || c->used < lru->used)) {
+                    lru = c;
+                }
+            }
+            if (lru != NULL) {
+                fsimage_gcr_drop_half_track(fsimage, lru);
+            }
+        }
+#endif
+
+        if (fsimage_gcr_read_half_track(image, half_track, &t->raw) < 0) {
+            gcr_invalidate_index(&t->raw);
+            lib_free(t->raw.data);
+            t->raw.data = NULL;
+            t->raw.size = 0;
+            return NULL;
+        }
+        fsimage->track_cache.num++;
+    }
+
+    t->used = ++fsimage->track_cache.clock;
+    return &t->raw;
+}
+
+/** \brief  Write all modified resident tracks to the image
+ *
+ * \return 0 on success, -1 if any track could not be written
+ */
+int fsimage_gcr_flush_tracks(disk_image_t *image)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    unsigned int i;
+    int rc = 0;
+
+    if (fsimage->track_cache.num_dirty == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < MAX_GCR_TRACKS; i++) {
+        fsimage_gcr_track_t *t = &fsimage->track_cache.tracks[i];
+        if (t->dirty) {
+            t->dirty = 0;
+            fsimage->track_cache.num_dirty--;
+            if (fsimage_gcr_write_half_track(image, i + 2, &t->raw) < 0) {
+                /* the resident copy no longer matches the image */
+                fsimage_gcr_drop_half_track(fsimage, t);
+                rc = -1;
+            }
+        }
+    }
+
+    return rc;
+}
+
+/** \brief  Check whether modified tracks have been held back long enough
+ *
+ * \return  non-zero if the oldest dirty track exceeds the flush interval
+ */
+int fsimage_gcr_flush_due(const disk_image_t *image)
+{
+    const fsimage_t *fsimage = image->media.fsimage;
+
+    return fsimage->track_cache.num_dirty > 0 && fsimage->mem.interval != 0
+           && (uint32_t)(archdep_ticks_ms() - fsimage->track_cache.dirty_since) >= fsimage->mem.interval;
+}
+
+/* Release all resident tracks, needed when the image is closed or changed
+   behind the cache's back.  Modified tracks must be flushed before.  */
+void fsimage_gcr_drop_tracks(disk_image_t *image)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+
+    if (fsimage->track_cache.tracks != NULL) {
+        unsigned int i;
+
+        for (i = 0; i < MAX_GCR_TRACKS; i++) {
+            fsimage_gcr_drop_half_track(fsimage, &fsimage->track_cache.tracks[i]);
+        }
+        lib_free(fsimage->track_cache.tracks);
+        fsimage->track_cache.tracks = NULL;
+    }
 }
 
 /*-----------------------------------------------------------------------*/
 /* Write an entire GCR track to the disk image.  */
 
+typedef struct fsimage_gcr_write_s {
+    fsimage_t *fsimage;
+    uint8_t *data;
+} fsimage_gcr_write_t;
+
+/* completion of a track write, may run in the I/O worker */
+static void fsimage_gcr_write_done(void *param, size_t count)
+{
+    fsimage_gcr_write_t *w = param;
+
+    if (count != 1) {
+        w->fsimage->io_error = 1;
+    }
+    lib_free(w->data);
+    lib_free(w);
+}
+
 int fsimage_gcr_write_half_track(disk_image_t *image, unsigned int half_track,
                                  const disk_track_t *raw)
 {
-    int gap;
     int extend = 0;
-    long res;
+    int res;
     uint16_t max_track_length;
     uint8_t buf[4];
     long offset;
     fsimage_t *fsimage;
+    fsimage_gcr_write_t *w;
     uint8_t num_half_tracks;
+    uint32_t speed;
 
     fsimage = image->media.fsimage;
 
-    offset = fsimage_gcr_seek_half_track(fsimage, half_track, &max_track_length, &num_half_tracks);
+    /* a track written from elsewhere replaces the resident copy */
+    if (fsimage->track_cache.tracks != NULL && half_track >= 2
+        && half_track - 2 < MAX_GCR_TRACKS
+        && fsimage->track_cache.tracks[half_track - 2].raw.data != raw->data) {
+        fsimage_gcr_drop_half_track(fsimage, &fsimage->track_cache.tracks[half_track - 2]);
+    }
+
+    offset = fsimage_gcr_seek_half_track(image, half_track);
     if (offset < 0) {
         return -1;
     }
+    max_track_length = fsimage->gcr.max_track_length;
+    num_half_tracks = fsimage->gcr.num_half_tracks;
     if (image->read_only != 0) {
         log_error(fsimage_gcr_log,
                   "Attempt to write to read-only disk image.");
@@ -265,30 +447,26 @@ int fsimage_gcr_write_half_track(disk_image_t *image, unsigned int half_track,
     }
 
     if (raw->data != NULL) {
-        util_word_to_le_buf(buf, (uint16_t)raw->size);
-
-        if (util_fpwrite(fsimage->fd, buf, 2, offset) < 0) {
-            log_error(fsimage_gcr_log, "Could not write GCR disk image.");
-            return -1;
-        }
-
-        /* Clear gap between the end of the actual track and the start of
-           the next track.  */
-        if (archdep_fwrite(raw->data, raw->size, 1, fsimage->fd) < 1) {
+        /* Length, track data and the cleared gap up to the start of the
+           next track go out as one request that the I/O worker may complete
+           in the background, errors are reported by fsimage_flush().  */
+        w = lib_malloc(sizeof(fsimage_gcr_write_t));
+        w->fsimage = fsimage;
+        w->data = lib_calloc(1, 2 + max_track_length);
+        util_word_to_le_buf(w->data, (uint16_t)raw->size);
+        memcpy(w->data + 2, raw->data, raw->size);
+
+        if (fsimage->mem.data != NULL || fsimage->overlay != NULL) {
+            /* loaded image or delta file, nothing to wait for */
+            res = fsimage_pwrite(fsimage, w->data, 2 + max_track_length, offset);
+            fsimage_gcr_write_done(w, res < 0 ? 0 : 1);
+        } else if (archdep_awrite(w->data, 2 + max_track_length, 1, offset, fsimage->fd,
+                                  fsimage_gcr_write_done, w) < 0) {
+            lib_free(w->data);
+            lib_free(w);
             log_error(fsimage_gcr_log, "Could not write GCR disk image.");
             return -1;
         }
-        gap = max_track_length - raw->size;
-
-        if (gap > 0) {
-            uint8_t *padding = lib_calloc(1, gap);
-            res = archdep_fwrite(padding, gap, 1, fsimage->fd);
-            lib_free(padding);
-            if (res < 1) {
-                log_error(fsimage_gcr_log, "Could not write GCR disk image.");
-                return -1;
-            }
-        }
 
         if (extend) {
             /* FIXME: danger zone: 'DWORD' is a loose term, doesn't indicate
@@ -297,22 +475,23 @@ int fsimage_gcr_write_half_track(disk_image_t *image, unsigned int half_track,
              *        -- compyx 2020-07-24
              */
             util_dword_to_le_buf(buf, (uint32_t)offset);
-            if (util_fpwrite(fsimage->fd, buf, 4, 12 + (half_track - 2) * 4) < 0) {
+            if (fsimage_pwrite(fsimage, buf, 4, 12 + (half_track - 2) * 4) < 0) {
                 log_error(fsimage_gcr_log, "Could not write GCR disk image.");
                 return -1;
             }
+            fsimage->gcr.offsets[half_track - 2] = (uint32_t)offset;
 
-            util_dword_to_le_buf(buf, disk_image_speed_map(image->type, half_track / 2));
-            if (util_fpwrite(fsimage->fd, buf, 4, 12 + (half_track - 2 + num_half_tracks) * 4) < 0) {
+            speed = disk_image_speed_map(image->type, half_track / 2);
+            util_dword_to_le_buf(buf, speed);
+            if (fsimage_pwrite(fsimage, buf, 4, 12 + (half_track - 2 + num_half_tracks) * 4) < 0) {
                 log_error(fsimage_gcr_log, "Could not write GCR disk image.");
                 return -1;
             }
+            fsimage->gcr.speeds[half_track - 2] = speed;
         }
     }
 
-    /* Make sure the stream is visible to other readers.  */
-    archdep_fflush(fsimage->fd);
-
+    /* The stream is flushed by fsimage_flush(), not after every track.  */
     return 0;
 }
 
@@ -338,15 +517,11 @@ int fsimage_gcr_read_sector(const disk_image_t *image, uint8_t *buf, const disk_
     }
 
     if (image->gcr == NULL) {
-        disk_track_t raw;
-        if (fsimage_gcr_read_track(image, dadr->track, &raw) < 0) {
+        disk_track_t *raw = fsimage_gcr_get_half_track(image, dadr->track << 1);
+        if (raw == NULL) {
             return -1;
         }
-        if (raw.data == NULL) {
-            return CBMDOS_IPE_NOT_READY;
-        }
-        rf = gcr_read_sector(&raw, buf, (uint8_t)dadr->sector, image->id);
-        lib_free(raw.data);
+        rf = gcr_read_sector(raw, buf, (uint8_t)dadr->sector, image->id);
     } else {
        rf = gcr_read_sector(&image->gcr->tracks[(dadr->track * 2) - 2], buf, (uint8_t)dadr->sector, image->id);
     }
@@ -374,23 +549,37 @@ int fsimage_gcr_write_sector(disk_image_t *image, const uint8_t *buf,
     }
 
     if (image->gcr == NULL) {
-        disk_track_t raw;
-        if (fsimage_gcr_read_track(image, dadr->track, &raw) < 0
-            || raw.data == NULL) {
+        fsimage_t *fsimage = image->media.fsimage;
+        fsimage_gcr_track_t *t;
+        disk_track_t *raw;
+
+#if FSIMAGE_GCR_RESIDENT_TRACKS > 0
+        /* keep the number of resident tracks bounded */
+        if (fsimage->track_cache.num_dirty >= FSIMAGE_GCR_RESIDENT_TRACKS
+            && fsimage_gcr_flush_tracks(image) < 0) {
             return -1;
         }
-        if (gcr_write_sector(&raw, buf, (uint8_t)dadr->sector, image->id) != CBMDOS_FDC_ERR_OK) {
+#endif
+
+        raw = fsimage_gcr_get_half_track(image, dadr->track << 1);
+        if (raw == NULL) {
+            return -1;
+        }
+        if (gcr_write_sector(raw, buf, (uint8_t)dadr->sector, image->id) != CBMDOS_FDC_ERR_OK) {
             log_error(fsimage_gcr_log,
                       "Could not find track %u sector %u in disk image",
                       dadr->track, dadr->sector);
-            lib_free(raw.data);
             return -1;
         }
-        if (fsimage_gcr_write_track(image, dadr->track, &raw) < 0) {
-            lib_free(raw.data);
-            return -1;
+
+        t = &fsimage->track_cache.tracks[(dadr->track << 1) - 2];
+        if (!t->dirty) {
+            if (fsimage->track_cache.num_dirty == 0) {
+                fsimage->track_cache.dirty_since = archdep_ticks_ms();
+            }
+            t->dirty = 1;
+            fsimage->track_cache.num_dirty++;
         }
-        lib_free(raw.data);
     } else {
         if (gcr_write_sector(&image->gcr->tracks[(dadr->track * 2) - 2], buf, (uint8_t)dadr->sector, image->id) != CBMDOS_FDC_ERR_OK) {
             log_error(fsimage_gcr_log,
@@ -422,15 +611,11 @@ int fsimage_gcr_read_disk_id(const struct disk_image_s *image, uint8_t track, ui
 
   if (image->gcr == NULL) 
     {
-      disk_track_t raw;
-      if( fsimage_gcr_read_track(image, track, &raw) < 0 )
+      disk_track_t *raw = fsimage_gcr_get_half_track(image, track << 1);
+      if( raw == NULL )
         return CBMDOS_IPE_NOT_READY;
 
-      if (raw.data == NULL)
-        return CBMDOS_IPE_NOT_READY;
-      
-      rf = gcr_read_sector_id(&raw, id, sector);
-      lib_free(raw.data);
+      rf = gcr_read_sector_id(raw, id, sector);
     }
   else 
     rf = gcr_read_sector_id(&image->gcr->tracks[(track * 2) - 2], id, sector);
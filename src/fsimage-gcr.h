@@ -29,6 +29,19 @@
 
 #include "types.h"
 
+/** \brief  Number of half tracks kept in memory, 0 keeps every track read
+ *
+ * Applies per image to the G64/G71 tracks and to the GCR rendering of P64
+ * tracks.  16 half tracks take about 128 KiB.
+ */
+#ifndef FSIMAGE_GCR_RESIDENT_TRACKS
+#ifdef ARDUINO
+#define FSIMAGE_GCR_RESIDENT_TRACKS 2
+#else
+#define FSIMAGE_GCR_RESIDENT_TRACKS 16
+#endif
+#endif
+
 struct disk_image_s;
 struct disk_track_s;
 struct disk_addr_s;
@@ -36,6 +49,7 @@ struct disk_addr_s;
 void fsimage_gcr_init(void);
 
 int fsimage_read_gcr_image(const disk_image_t *image);
+int fsimage_gcr_read_header(struct disk_image_s *image);
 
 int fsimage_gcr_read_sector(const struct disk_image_s *image, uint8_t *buf,
                             const struct disk_addr_s *dadr);
@@ -47,6 +61,10 @@ int fsimage_gcr_read_half_track(const struct disk_image_s *image,
 int fsimage_gcr_write_half_track(struct disk_image_s *image,
                                  unsigned int half_track, const struct disk_track_s *raw);
 
+int fsimage_gcr_flush_tracks(struct disk_image_s *image);
+int fsimage_gcr_flush_due(const struct disk_image_s *image);
+void fsimage_gcr_drop_tracks(struct disk_image_s *image);
+
 int fsimage_gcr_read_disk_id(const struct disk_image_s *image, uint8_t track, uint8_t sector, uint16_t *id);
 
 #endif
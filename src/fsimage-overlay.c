@@ -0,0 +1,279 @@
+/** \file   fsimage-overlay.c
+ *
+ * \brief   Copy-on-write delta files for shared read-only images
+ *
+ * An overlay combines a base image, which is only ever read, with a delta
+ * file that receives all writes.  The delta file holds a header, a bitmap
+ * with one bit per 256 byte block of the base image and the modified blocks
+ * at their original offsets behind that.  Blocks that were never written
+ * are not stored, so on file systems supporting sparse files the delta only
+ * grows with the data that actually changed.
+ *
+ * Delta file layout:
+ *
+ *   0      magic "VDRIVE DELTA" followed by 0x1a
+ *   16     size of the base image (32 bit little endian)
+ *   256    block bitmap, bit n & 7 of byte n / 8 set if block n is stored
+ *   data   block data, data = 256 + bitmap size rounded up to 256
+ *
+ * This file is part of VICE, the Versatile Commodore Emulator.
+ * See README for copyright notice.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ *  02111-1307  USA.
+ *
+ */
+
+#include <string.h>
+
+#include "archdep.h"
+#include "fsimage-overlay.h"
+#include "lib.h"
+#include "log.h"
+#include "types.h"
+#include "util.h"
+
+#define OVERLAY_MAGIC           "VDRIVE DELTA\x1a"
+#define OVERLAY_MAGIC_LEN       13
+#define OVERLAY_BASE_LEN_OFFSET 16
+#define OVERLAY_BITMAP_OFFSET   256
+
+struct fsimage_overlay_s {
+    ADFILE *fd;             /* delta file */
+    ADFILE *base;           /* shared base image, read only */
+    size_t base_len;
+    size_t blocks;          /* number of 256 byte blocks in the base image */
+    uint8_t *bitmap;        /* blocks stored in the delta file */
+    size_t bitmap_len;
+    int bitmap_dirty;
+    long data_offset;
+};
+
+static log_t fsimage_overlay_log = LOG_DEFAULT;
+
+
+static int fsimage_overlay_present(const fsimage_overlay_t *overlay, size_t block)
+{
+    return (overlay->bitmap[block >> 3] >> (block & 7)) & 1;
+}
+
+/** \brief  Open the delta file \a name for \a base, creating it if needed
+ *
+ * \return  overlay or NULL if the delta file cannot be opened or does not
+ *          belong to an image of the size of \a base
+ */
+fsimage_overlay_t *fsimage_overlay_open(const char *name, ADFILE *base)
+{
+    fsimage_overlay_t *overlay;
+    uint8_t header[OVERLAY_BITMAP_OFFSET];
+    off_t base_len;
+    int created = 0;
+
+    base_len = archdep_file_size(base);
+    if (base_len <= 0) {
+        return NULL;
+    }
+
+    overlay = lib_calloc(1, sizeof(fsimage_overlay_t));
+    overlay->base = base;
+    overlay->base_len = (size_t)base_len;
+    overlay->blocks = (overlay->base_len + 255) / 256;
+    overlay->bitmap_len = (overlay->blocks + 7) / 8;
+    overlay->bitmap = lib_calloc(1, overlay->bitmap_len);
+    overlay->data_offset = OVERLAY_BITMAP_OFFSET
+                           + (long)((overlay->bitmap_len + 255) & ~(size_t)255);
+
+    overlay->fd = archdep_fopen(name, MODE_READ_WRITE);
+    if (!archdep_fisopen(overlay->fd)) {
+        /* create the file, then reopen it for reading and writing */
+        overlay->fd = archdep_fopen(name, MODE_WRITE);
+        if (archdep_fisopen(overlay->fd)) {
+            archdep_fclose(overlay->fd);
+            overlay->fd = archdep_fopen(name, MODE_READ_WRITE);
+            created = 1;
+        }
+    }
+    if (!archdep_fisopen(overlay->fd)) {
+        log_error(fsimage_overlay_log, "Cannot open delta file `%s'.", name);
+        lib_free(overlay->bitmap);
+        lib_free(overlay);
+        return NULL;
+    }
+
+    if (created) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, OVERLAY_MAGIC, OVERLAY_MAGIC_LEN);
+        util_dword_to_le_buf(header + OVERLAY_BASE_LEN_OFFSET, (uint32_t)overlay->base_len);
+        if (util_fpwrite(overlay->fd, header, sizeof(header), 0) < 0
+            || util_fpwrite(overlay->fd, overlay->bitmap, overlay->bitmap_len,
+                            OVERLAY_BITMAP_OFFSET) < 0) {
+            log_error(fsimage_overlay_log, "Cannot write delta file `%s'.", name);
+            fsimage_overlay_close(overlay);
+            return NULL;
+        }
+    } else if (util_fpread(overlay->fd, header, sizeof(header), 0) < 0
+               || memcmp(header, OVERLAY_MAGIC, OVERLAY_MAGIC_LEN) != 0
+               || util_le_buf_to_dword(header + OVERLAY_BASE_LEN_OFFSET) != (uint32_t)overlay->base_len
+               || util_fpread(overlay->fd, overlay->bitmap, overlay->bitmap_len,
+                              OVERLAY_BITMAP_OFFSET) < 0) {
+        log_error(fsimage_overlay_log, "`%s' is not a delta file for this image.", name);
+        fsimage_overlay_close(overlay);
+        return NULL;
+    }
+
+    return overlay;
+}
+
+/** \brief  Write the block bitmap if it changed and close the delta file
+ *
+ * \return  0 on success, -1 if the bitmap could not be written
+ */
+int fsimage_overlay_close(fsimage_overlay_t *overlay)
+{
+    int rc;
+
+    rc = fsimage_overlay_flush(overlay);
+    archdep_fclose(overlay->fd);
+    lib_free(overlay->bitmap);
+    lib_free(overlay);
+
+    return rc;
+}
+
+/** \brief  Read from the combined image, stored blocks come from the delta
+ *
+ * \return  0 on success, -1 on error
+ */
+int fsimage_overlay_read(fsimage_overlay_t *overlay, void *buf, size_t num,
+                         long offset)
+{
+    size_t pos, n, next;
+    int in_delta;
+
+    if (offset < 0 || (size_t)offset + num > overlay->base_len) {
+        return -1;
+    }
+
+    pos = (size_t)offset;
+    while (num > 0) {
+        /* collect the run of blocks that come from the same file */
+        next = pos / 256;
+        in_delta = fsimage_overlay_present(overlay, next);
+        n = ++next * 256 - pos;
+        while (n < num && fsimage_overlay_present(overlay, next) == in_delta) {
+            n += 256;
+            next++;
+        }
+        n = n < num ? n : num;
+
+        if (in_delta) {
+            if (util_fpread(overlay->fd, buf, n, overlay->data_offset + (long)pos) < 0) {
+                return -1;
+            }
+        } else if (util_fpread(overlay->base, buf, n, (long)pos) < 0) {
+            return -1;
+        }
+
+        buf = (uint8_t *)buf + n;
+        pos += n;
+        num -= n;
+    }
+
+    return 0;
+}
+
+/* copy a block of the base image into the delta before writing part of it */
+static int fsimage_overlay_copy_up(fsimage_overlay_t *overlay, size_t block)
+{
+    uint8_t data[256];
+    size_t len;
+
+    if (fsimage_overlay_present(overlay, block)) {
+        return 0;
+    }
+
+    len = overlay->base_len - block * 256;
+    len = len < 256 ? len : 256;
+    if (util_fpread(overlay->base, data, len, (long)(block * 256)) < 0
+        || util_fpwrite(overlay->fd, data, len, overlay->data_offset + (long)(block * 256)) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/** \brief  Write to the delta file only
+ *
+ * The image can not grow beyond the size of the base image.
+ *
+ * \return  0 on success, -1 on error
+ */
+int fsimage_overlay_write(fsimage_overlay_t *overlay, const void *buf,
+                          size_t num, long offset)
+{
+    size_t first, last, block, end;
+
+    if (offset < 0 || (size_t)offset + num > overlay->base_len) {
+        log_error(fsimage_overlay_log, "Cannot extend an image with a delta file.");
+        return -1;
+    }
+    if (num == 0) {
+        return 0;
+    }
+
+    end = (size_t)offset + num;
+    first = (size_t)offset / 256;
+    last = (end - 1) / 256;
+
+    /* blocks that are only partly overwritten start out as the base data */
+    if ((size_t)offset % 256 != 0 && fsimage_overlay_copy_up(overlay, first) < 0) {
+        return -1;
+    }
+    if (end % 256 != 0 && end != overlay->base_len
+        && fsimage_overlay_copy_up(overlay, last) < 0) {
+        return -1;
+    }
+
+    if (util_fpwrite(overlay->fd, buf, num, overlay->data_offset + offset) < 0) {
+        return -1;
+    }
+
+    for (block = first; block <= last; block++) {
+        if (!fsimage_overlay_present(overlay, block)) {
+            overlay->bitmap[block >> 3] |= (uint8_t)(1 << (block & 7));
+            overlay->bitmap_dirty = 1;
+        }
+    }
+
+    return 0;
+}
+
+/** \brief  Write the block bitmap to the delta file if it changed
+ *
+ * \return  0 on success, -1 on error
+ */
+int fsimage_overlay_flush(fsimage_overlay_t *overlay)
+{
+    if (overlay->bitmap_dirty) {
+        if (util_fpwrite(overlay->fd, overlay->bitmap, overlay->bitmap_len,
+                         OVERLAY_BITMAP_OFFSET) < 0) {
+            log_error(fsimage_overlay_log, "Cannot write delta file bitmap.");
+            return -1;
+        }
+        overlay->bitmap_dirty = 0;
+    }
+
+    return archdep_fflush(overlay->fd) == 0 ? 0 : -1;
+}
@@ -0,0 +1,42 @@
+/** \file   fsimage-overlay.h
+ *
+ * \brief   Copy-on-write delta files for shared read-only images - header
+ *
+ * This file is part of VICE, the Versatile Commodore Emulator.
+ * See README for copyright notice.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ *  02111-1307  USA.
+ *
+ */
+
+#ifndef VICE_FSIMAGE_OVERLAY_H
+#define VICE_FSIMAGE_OVERLAY_H
+
+#include "archdep.h"
+#include "types.h"
+
+typedef struct fsimage_overlay_s fsimage_overlay_t;
+
+fsimage_overlay_t *fsimage_overlay_open(const char *name, ADFILE *base);
+int fsimage_overlay_close(fsimage_overlay_t *overlay);
+
+int fsimage_overlay_read(fsimage_overlay_t *overlay, void *buf, size_t num,
+                         long offset);
+int fsimage_overlay_write(fsimage_overlay_t *overlay, const void *buf,
+                          size_t num, long offset);
+int fsimage_overlay_flush(fsimage_overlay_t *overlay);
+
+#endif
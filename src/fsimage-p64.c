@@ -30,6 +30,7 @@
 #include "archdep.h"
 #include "diskconstants.h"
 #include "diskimage.h"
+#include "fsimage-gcr.h"
 #include "fsimage-p64.h"
 #include "fsimage.h"
 #include "cbmdos.h"
@@ -40,93 +41,140 @@
 #include "util.h"
 #include "p64.h"
 
+/* half tracks 0..84 of side 0 are used for sector access */
+#define P64_NUM_HALF_TRACKS 85
+
 static log_t fsimage_p64_log = LOG_DEFAULT;
 
 /*-----------------------------------------------------------------------*/
 /* Intial P64 buffer setup.  */
 
+/* Only the chunk container is checked when an image is read, the pulses of
+   each half track are range decoded when the track is first accessed.  The
+   file is mapped (or read once) just for that and copies of the chunks
+   are kept, so the image can be written back to the same file. */
 int fsimage_read_p64_image(const disk_image_t *image)
 {
-    TP64MemoryStream P64MemoryStreamInstance;
     PP64Image P64Image = (void*)image->p64;
     int rc;
     off_t lSize;
     void *buffer;
+    int mapped;
 
     fsimage_t *fsimage;
 
     fsimage = image->media.fsimage;
 
+    fsimage_p64_drop_tracks(image);
+
     lSize = archdep_file_size(fsimage->fd);
     if (lSize < 0) {
         log_error(fsimage_p64_log, "Failed to get size of P64 disk image.");
         return -1;
     }
-    buffer = lib_malloc((size_t)lSize);
-    if (util_fpread(fsimage->fd, buffer, (size_t)lSize, 0) < 0) {
-        lib_free(buffer);
-        log_error(fsimage_p64_log, "Could not read P64 disk image.");
-        return -1;
+    buffer = archdep_fmap(fsimage->fd, (size_t)lSize, 0);
+    mapped = buffer != NULL;
+    if (!mapped) {
+        buffer = lib_malloc((size_t)lSize);
+        if (util_fpread(fsimage->fd, buffer, (size_t)lSize, 0) < 0) {
+            lib_free(buffer);
+            log_error(fsimage_p64_log, "Could not read P64 disk image.");
+            return -1;
+        }
     }
 
     /*num_tracks = image->tracks;*/
 
-    P64MemoryStreamCreate(&P64MemoryStreamInstance);
-    P64MemoryStreamWrite(&P64MemoryStreamInstance, buffer, (p64_uint32_t)lSize);
-    P64MemoryStreamSeek(&P64MemoryStreamInstance, 0);
-    if (P64ImageReadFromStream(P64Image, &P64MemoryStreamInstance)) {
+    if (P64ImageReadFromBuffer(P64Image, buffer, (p64_uint32_t)lSize)) {
         rc = 0;
     } else {
         rc = -1;
         log_error(fsimage_p64_log, "Could not read P64 disk image stream.");
     }
-    P64MemoryStreamDestroy(&P64MemoryStreamInstance);
 
-    lib_free(buffer);
+    if (mapped) {
+        archdep_funmap(buffer, (size_t)lSize);
+    } else {
+        lib_free(buffer);
+    }
 
     return rc;
 }
 
+typedef struct fsimage_p64_writer_s {
+    ADFILE *fd;
+    long offset;
+} fsimage_p64_writer_t;
+
+/* P64ImageWriteToFunction() callback, appends to the image file */
+static p64_uint32_t fsimage_p64_write_data(void *param, p64_uint8_t *buffer, p64_uint32_t count)
+{
+    fsimage_p64_writer_t *writer = param;
+
+    if (count > 0 && util_fpwrite(writer->fd, buffer, count, writer->offset) < 0) {
+        return 0;
+    }
+    writer->offset += (long)count;
+    return count;
+}
+
+/** \brief  Write the pulse streams back to the image file
+ *
+ * Nothing is written if no track changed since the image was read.  Only
+ * modified tracks are encoded, the stored form of the others is reused.
+ */
 int fsimage_write_p64_image(const disk_image_t *image)
 {
-    TP64MemoryStream P64MemoryStreamInstance;
     PP64Image P64Image = (void*)image->p64;
-    int rc;
+    fsimage_p64_writer_t writer;
 
     fsimage_t *fsimage;
 
     fsimage = image->media.fsimage;
 
-    P64MemoryStreamCreate(&P64MemoryStreamInstance);
-    P64MemoryStreamClear(&P64MemoryStreamInstance);
-    if (P64ImageWriteToStream(P64Image, &P64MemoryStreamInstance)) {
-        if (util_fpwrite(fsimage->fd, P64MemoryStreamInstance.Data, P64MemoryStreamInstance.Size, 0) < 0) {
-            rc = -1;
-            log_error(fsimage_p64_log, "Could not write P64 disk image.");
-        } else {
-            archdep_fflush(fsimage->fd);
-            rc = 0;
-        }
-    } else {
-        rc = -1;
-        log_error(fsimage_p64_log, "Could not write P64 disk image stream.");
+    if (!P64ImageIsDirty(P64Image)) {
+        return 0;
     }
-    P64MemoryStreamDestroy(&P64MemoryStreamInstance);
 
-    return rc;
+    writer.fd = fsimage->fd;
+    writer.offset = 0;
+    if (!P64ImageWriteToFunction(P64Image, fsimage_p64_write_data, &writer)) {
+        log_error(fsimage_p64_log, "Could not write P64 disk image.");
+        return -1;
+    }
+    archdep_fflush(fsimage->fd);
+
+    return 0;
 }
 
 /*-----------------------------------------------------------------------*/
 /* Read an entire P64 track from the disk image.  */
 
+/* Convert the pulse stream of a half track to GCR */
+static void fsimage_p64_render_half_track(const disk_image_t *image, unsigned int half_track,
+                                          disk_track_t *raw)
+{
+    PP64Image P64Image = (void*)image->p64;
+    unsigned int track = half_track / 2;
+
+    raw->data = lib_malloc(NUM_MAX_MEM_BYTES_TRACK);
+    raw->size = (P64PulseStreamConvertToGCRWithLogic(&P64Image->PulseStreams[0][half_track], (void*)raw->data, NUM_MAX_MEM_BYTES_TRACK, disk_image_speed_map(image->type, track)) + 7) >> 3;
+
+    if (raw->size < 1) {
+        raw->size = disk_image_raw_track_size(image->type, track);
+        memset(raw->data, 0x55, raw->size);
+    }
+}
+
 int fsimage_p64_read_half_track(const disk_image_t *image, unsigned int half_track,
                                 disk_track_t *raw)
 {
     PP64Image P64Image = (void*)image->p64;
-    unsigned int track;
+    fsimage_t *fsimage = image->media.fsimage;
 
     raw->data = NULL;
     raw->size = 0;
+    raw->index = NULL;
     if (P64Image == NULL) {
         log_error(fsimage_p64_log, "P64 image not loaded.");
         return -1;
@@ -139,23 +187,93 @@ int fsimage_p64_read_half_track(const disk_image_t *image, unsigned int half_tra
         return -1;
     }
 
-    track = half_track / 2;
+    /* hand out a copy of the rendered track if there is one, rendering
+       is not worth caching for callers that read each track once */
+    if (fsimage->p64_gcr.tracks != NULL
+        && fsimage->p64_gcr.tracks[half_track].data != NULL) {
+        raw->size = fsimage->p64_gcr.tracks[half_track].size;
+        raw->data = lib_malloc(raw->size);
+        memcpy(raw->data, fsimage->p64_gcr.tracks[half_track].data, raw->size);
+        return 0;
+    }
 
-    raw->data = lib_malloc(NUM_MAX_MEM_BYTES_TRACK);
-    raw->size = (P64PulseStreamConvertToGCRWithLogic(&P64Image->PulseStreams[0][half_track], (void*)raw->data, NUM_MAX_MEM_BYTES_TRACK, disk_image_speed_map(image->type, track)) + 7) >> 3;
+    fsimage_p64_render_half_track(image, half_track, raw);
 
-    if (raw->size < 1) {
-        raw->size = disk_image_raw_track_size(image->type, track);
-        memset(raw->data, 0x55, raw->size);
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Rendered half tracks.  The GCR rendering of a pulse stream is kept for
+   further sector accesses until the stream changes or, with
+   FSIMAGE_GCR_RESIDENT_TRACKS set, it is evicted LRU.  */
+
+static void fsimage_p64_drop_half_track(fsimage_t *fsimage, unsigned int half_track)
+{
+    if (fsimage->p64_gcr.tracks != NULL
+        && fsimage->p64_gcr.tracks[half_track].data != NULL) {
+        gcr_free_track(&fsimage->p64_gcr.tracks[half_track]);
+        fsimage->p64_gcr.num--;
     }
+}
 
-    return 0;
+static disk_track_t *fsimage_p64_get_half_track(const disk_image_t *image,
+                                                unsigned int half_track)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    disk_track_t *raw;
+
+    if (image->p64 == NULL) {
+        log_error(fsimage_p64_log, "P64 image not loaded.");
+        return NULL;
+    }
+
+    if (fsimage->p64_gcr.tracks == NULL) {
+        fsimage->p64_gcr.tracks = lib_calloc(P64_NUM_HALF_TRACKS, sizeof(disk_track_t));
+        fsimage->p64_gcr.used = lib_calloc(P64_NUM_HALF_TRACKS, sizeof(uint32_t));
+    }
+
+    raw = &fsimage->p64_gcr.tracks[half_track];
+    if (raw->data == NULL) {
+#if FSIMAGE_GCR_RESIDENT_TRACKS > 0
+        if (fsimage->p64_gcr.num >= FSIMAGE_GCR_RESIDENT_TRACKS) {
+            unsigned int i, lru = P64_NUM_HALF_TRACKS;
+
+            for (i = 0; i < P64_NUM_HALF_TRACKS; i++) {
+                if (fsimage->p64_gcr.tracks[i].data != NULL
+                    && (lru == P64_NUM_HALF_TRACKS || fsimage->p64_gcr.used[i] < fsimage->p64_gcr.used[lru])) {
+                    lru = i;
+                }
+            }
+            if (lru != P64_NUM_HALF_TRACKS) {
+                fsimage_p64_drop_half_track(fsimage, lru);
+            }
+        }
+#endif
+        fsimage_p64_render_half_track(image, half_track, raw);
+        raw->data = lib_realloc(raw->data, raw->size);
+        fsimage->p64_gcr.num++;
+    }
+
+    fsimage->p64_gcr.used[half_track] = ++fsimage->p64_gcr.clock;
+    return raw;
 }
 
-static int fsimage_p64_read_track(const disk_image_t *image, unsigned int track,
-                                  disk_track_t *raw)
+/* Release all rendered half tracks, needed when the image is closed or
+   its pulse streams are reloaded.  */
+void fsimage_p64_drop_tracks(const disk_image_t *image)
 {
-    return fsimage_p64_read_half_track(image, track << 1, raw);
+    fsimage_t *fsimage = image->media.fsimage;
+    unsigned int i;
+
+    if (fsimage->p64_gcr.tracks != NULL) {
+        for (i = 0; i < P64_NUM_HALF_TRACKS; i++) {
+            fsimage_p64_drop_half_track(fsimage, i);
+        }
+        lib_free(fsimage->p64_gcr.tracks);
+        lib_free(fsimage->p64_gcr.used);
+        fsimage->p64_gcr.tracks = NULL;
+        fsimage->p64_gcr.used = NULL;
+    }
 }
 
 /*-----------------------------------------------------------------------*/
@@ -182,6 +300,7 @@ int fsimage_p64_write_half_track(disk_image_t *image, unsigned int half_track,
     }
 
     P64PulseStreamConvertFromGCR(&P64Image->PulseStreams[0][half_track], (void*)raw->data, raw->size << 3);
+    fsimage_p64_drop_half_track(image->media.fsimage, half_track);
 
     return 0;
     /* image flush will happen on close; added by Roberto Muscedere on 20210125 */
@@ -208,6 +327,7 @@ static int fsimage_p64_write_track(disk_image_t *image, unsigned int track,
     }
 
     P64PulseStreamConvertFromGCR(&P64Image->PulseStreams[0][track << 1], (void*)gcr_track_start_ptr, gcr_track_size << 3);
+    fsimage_p64_drop_half_track(image->media.fsimage, track << 1);
 
     return 0;
     /* image flush will happen on close; added by Roberto Muscedere on 20210125 */
@@ -223,7 +343,7 @@ int fsimage_p64_read_sector(const disk_image_t *image, uint8_t *buf,
                             const disk_addr_t *dadr)
 {
     fdc_err_t rf;
-    disk_track_t raw;
+    disk_track_t *raw;
 
     if (dadr->track > 42) {
         log_error(fsimage_p64_log,
@@ -232,15 +352,12 @@ int fsimage_p64_read_sector(const disk_image_t *image, uint8_t *buf,
         return -1;
     }
 
-    if (fsimage_p64_read_track(image, dadr->track, &raw) < 0) {
+    raw = fsimage_p64_get_half_track(image, dadr->track << 1);
+    if (raw == NULL) {
         return -1;
     }
-    if (raw.data == NULL) {
-        return CBMDOS_IPE_NOT_READY;
-    }
 
-    rf = gcr_read_sector(&raw, buf, (uint8_t)dadr->sector, -1);
-    lib_free(raw.data);
+    rf = gcr_read_sector(raw, buf, (uint8_t)dadr->sector, -1);
     if (rf != CBMDOS_FDC_ERR_OK) {
         log_error(fsimage_p64_log,
                 "Cannot find track: %u sector: %u within P64 image.",
@@ -282,7 +399,7 @@ int fsimage_p64_read_sector(const disk_image_t *image, uint8_t *buf,
 int fsimage_p64_write_sector(disk_image_t *image, const uint8_t *buf,
                              const disk_addr_t *dadr)
 {
-    disk_track_t raw;
+    disk_track_t *raw;
 
     if (dadr->track > 42) {
         log_error(fsimage_p64_log,
@@ -291,31 +408,30 @@ int fsimage_p64_write_sector(disk_image_t *image, const uint8_t *buf,
         return -1;
     }
 
-    if (fsimage_p64_read_track(image, dadr->track, &raw) < 0
-        || raw.data == NULL) {
+    raw = fsimage_p64_get_half_track(image, dadr->track << 1);
+    if (raw == NULL) {
         log_error(fsimage_p64_log,
                 "Cannot read track %u from P64 image.",
                 dadr->track);
         return -1;
     }
 
-    if (gcr_write_sector(&raw, buf, (uint8_t)dadr->sector, -1) != CBMDOS_FDC_ERR_OK) {
+    if (gcr_write_sector(raw, buf, (uint8_t)dadr->sector, -1) != CBMDOS_FDC_ERR_OK) {
         log_error(fsimage_p64_log,
                 "Could not find track %u sector %u in disk image",
                 dadr->track, dadr->sector);
-        lib_free(raw.data);
         return -1;
     }
 
-    if (fsimage_p64_write_track(image, dadr->track, raw.size, raw.data) < 0) {
+    /* drops the rendering, it is redone from the new pulse stream */
+    if (fsimage_p64_write_track(image, dadr->track, raw->size, raw->data) < 0) {
         log_error(fsimage_p64_log,
                 "Failed writing track %u to disk image.",
                 dadr->track);
-        lib_free(raw.data);
+        fsimage_p64_drop_half_track(image->media.fsimage, dadr->track << 1);
         return -1;
     }
 
-    lib_free(raw.data);
     return 0;
 }
 
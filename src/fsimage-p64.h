@@ -38,6 +38,7 @@ void fsimage_p64_init(void);
 int fsimage_read_p64_image(const disk_image_t *image);
 
 int fsimage_write_p64_image(const disk_image_t *image);
+void fsimage_p64_drop_tracks(const disk_image_t *image);
 
 int fsimage_p64_read_half_track(const struct disk_image_s *image,
                                 unsigned int half_track,
@@ -469,6 +469,10 @@ static int disk_image_check_for_gcr(disk_image_t *image)
     image->tracks = header[9] / 2;
     image->max_half_tracks = header[9];
 
+    if (fsimage_gcr_read_header(image) < 0) {
+        return 0;
+    }
+
     uint16_t id;
     if( fsimage_gcr_read_disk_id(image, 18, 0, &id)==CBMDOS_IPE_OK )
       image->id = id;
@@ -0,0 +1,306 @@
+/** \file   fsimage-shadow.c
+ *
+ * \brief   Decoded sector shadow of GCR based images
+ *
+ * When a G64/G71 image is attached, every track is decoded once, P64 tracks
+ * are decoded when first accessed.  Tracks on which all standard sectors
+ * decode without error are kept as plain 256 byte sectors and served from
+ * memory.  Tracks with non-standard contents (copy protection, foreign
+ * headers, checksum errors) are flagged and left to the GCR code.  Sectors
+ * written to clean tracks only update the shadow and are encoded into the
+ * image when it is flushed.
+ *
+ * This file is part of VICE, the Versatile Commodore Emulator.
+ * See README for copyright notice.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ *  02111-1307  USA.
+ *
+ */
+
+#include <string.h>
+
+#include "archdep.h"
+#include "cbmdos.h"
+#include "diskimage.h"
+#include "fsimage-gcr.h"
+#include "fsimage-p64.h"
+#include "fsimage-shadow.h"
+#include "fsimage.h"
+#include "gcr.h"
+#include "lib.h"
+#include "log.h"
+#include "types.h"
+
+#define SHADOW_TRACK_UNKNOWN    0   /* not decoded yet */
+#define SHADOW_TRACK_CLEAN      1   /* all sectors held in the shadow */
+#define SHADOW_TRACK_RAW        2   /* non-standard, handled by the GCR code */
+
+struct fsimage_shadow_s {
+    unsigned int tracks;
+    unsigned int *first;    /* index of the first sector of each track, plus
+                               the total number of sectors at [tracks] */
+    uint8_t *state;         /* one SHADOW_TRACK_* per track */
+    uint8_t *dirty;         /* one flag per sector not yet in the image */
+    unsigned int num_dirty;
+    uint32_t dirty_since;   /* archdep_ticks_ms() of the oldest dirty sector */
+    uint8_t *data;
+};
+
+static log_t fsimage_shadow_log = LOG_DEFAULT;
+
+
+/* Decode all sectors of a track into the shadow, flag the track if any of
+   them is not a plain DOS sector */
+static void fsimage_shadow_decode_track(const disk_image_t *image,
+                                        fsimage_shadow_t *shadow,
+                                        unsigned int track)
+{
+    disk_track_t raw;
+    unsigned int sector, first, num;
+    int32_t id;
+    uint8_t header_track;
+    int rc;
+
+    shadow->state[track - 1] = SHADOW_TRACK_RAW;
+
+    if (image->type == DISK_IMAGE_TYPE_P64) {
+        rc = fsimage_p64_read_half_track(image, track << 1, &raw);
+        id = -1;
+    } else {
+        rc = fsimage_gcr_read_half_track(image, track << 1, &raw);
+        id = (int32_t)image->id;
+    }
+
+    if (rc == 0 && raw.data != NULL
+        && gcr_read_track_number(&raw, &header_track) == CBMDOS_FDC_ERR_OK
+        && header_track == track) {
+        first = shadow->first[track - 1];
+        num = shadow->first[track] - first;
+        for (sector = 0; sector < num; sector++) {
+            if (gcr_read_sector(&raw, shadow->data + (first + sector) * 256,
+                                (uint8_t)sector, id) != CBMDOS_FDC_ERR_OK) {
+                break;
+            }
+        }
+        if (sector == num) {
+            shadow->state[track - 1] = SHADOW_TRACK_CLEAN;
+        }
+    }
+
+    gcr_invalidate_index(&raw);
+    lib_free(raw.data);
+}
+
+/** \brief  Decode all tracks of an image into a new shadow
+ *
+ * The tracks of P64 images are left to be decoded on first access.
+ *
+ * \return  shadow or NULL if no track of the image is a plain DOS track
+ */
+fsimage_shadow_t *fsimage_shadow_create(const disk_image_t *image)
+{
+    fsimage_shadow_t *shadow;
+    unsigned int track, clean = 0;
+
+    if (image->tracks == 0) {
+        return NULL;
+    }
+
+    shadow = lib_calloc(1, sizeof(fsimage_shadow_t));
+    shadow->tracks = image->tracks;
+    shadow->first = lib_malloc((shadow->tracks + 1) * sizeof(unsigned int));
+    shadow->first[0] = 0;
+    for (track = 1; track <= shadow->tracks; track++) {
+        shadow->first[track] = shadow->first[track - 1]
+                               + disk_image_sector_per_track(image->type, track);
+    }
+    shadow->state = lib_calloc(shadow->tracks, 1);
+    shadow->dirty = lib_calloc(shadow->first[shadow->tracks], 1);
+    shadow->data = lib_malloc(shadow->first[shadow->tracks] * 256);
+
+    /* decoding now would range decode the pulses of every track */
+    if (image->type == DISK_IMAGE_TYPE_P64) {
+        return shadow;
+    }
+
+    for (track = 1; track <= shadow->tracks; track++) {
+        fsimage_shadow_decode_track(image, shadow, track);
+        if (shadow->state[track - 1] == SHADOW_TRACK_CLEAN) {
+            clean++;
+        }
+    }
+
+    if (clean == 0) {
+        fsimage_shadow_destroy(shadow);
+        return NULL;
+    }
+
+    return shadow;
+}
+
+void fsimage_shadow_destroy(fsimage_shadow_t *shadow)
+{
+    if (shadow != NULL) {
+        lib_free(shadow->first);
+        lib_free(shadow->state);
+        lib_free(shadow->dirty);
+        lib_free(shadow->data);
+        lib_free(shadow);
+    }
+}
+
+/* Index of a sector in the shadow, -1 if its track is not shadowed */
+static int fsimage_shadow_index(const disk_image_t *image, fsimage_shadow_t *shadow,
+                                const disk_addr_t *dadr)
+{
+    if (dadr->track < 1 || dadr->track > shadow->tracks
+        || dadr->sector >= shadow->first[dadr->track] - shadow->first[dadr->track - 1]) {
+        return -1;
+    }
+
+    if (shadow->state[dadr->track - 1] == SHADOW_TRACK_UNKNOWN) {
+        fsimage_shadow_decode_track(image, shadow, dadr->track);
+    }
+    if (shadow->state[dadr->track - 1] != SHADOW_TRACK_CLEAN) {
+        return -1;
+    }
+
+    return (int)(shadow->first[dadr->track - 1] + dadr->sector);
+}
+
+/** \brief  Read a sector from the shadow
+ *
+ * \return  0 if the sector was copied to \a buf, -1 if it must be read from
+ *          the image
+ */
+int fsimage_shadow_read(const disk_image_t *image, uint8_t *buf,
+                        const disk_addr_t *dadr)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    int i = fsimage_shadow_index(image, fsimage->shadow, dadr);
+
+    if (i < 0) {
+        return -1;
+    }
+
+    memcpy(buf, fsimage->shadow->data + i * 256, 256);
+    return 0;
+}
+
+/** \brief  Store a sector in the shadow, to be encoded on the next flush
+ *
+ * \return  0 if the sector was stored, -1 if it must be written to the image
+ */
+int fsimage_shadow_write(disk_image_t *image, const uint8_t *buf,
+                         const disk_addr_t *dadr)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    fsimage_shadow_t *shadow = fsimage->shadow;
+    int i;
+
+    /* let the image backend report write protection */
+    if (image->read_only) {
+        return -1;
+    }
+
+    i = fsimage_shadow_index(image, shadow, dadr);
+    if (i < 0) {
+        return -1;
+    }
+
+    memcpy(shadow->data + i * 256, buf, 256);
+    if (!shadow->dirty[i]) {
+        if (shadow->num_dirty == 0) {
+            shadow->dirty_since = archdep_ticks_ms();
+        }
+        shadow->dirty[i] = 1;
+        shadow->num_dirty++;
+    }
+
+    return 0;
+}
+
+/** \brief  Check whether written sectors have been held back long enough
+ *
+ * \return  non-zero if the oldest unwritten sector exceeds the flush interval
+ */
+int fsimage_shadow_flush_due(const disk_image_t *image)
+{
+    const fsimage_t *fsimage = image->media.fsimage;
+
+    return fsimage->shadow->num_dirty > 0 && fsimage->mem.interval != 0
+           && (uint32_t)(archdep_ticks_ms() - fsimage->shadow->dirty_since) >= fsimage->mem.interval;
+}
+
+/** \brief  Encode the written sectors into the image
+ *
+ * \return  0 on success, -1 if any sector could not be written
+ */
+int fsimage_shadow_flush(disk_image_t *image)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    fsimage_shadow_t *shadow = fsimage->shadow;
+    disk_addr_t dadr;
+    unsigned int i;
+    int rc = 0, res;
+
+    if (shadow->num_dirty == 0) {
+        return 0;
+    }
+
+    for (dadr.track = 1; dadr.track <= shadow->tracks; dadr.track++) {
+        for (i = shadow->first[dadr.track - 1]; i < shadow->first[dadr.track]; i++) {
+            if (!shadow->dirty[i]) {
+                continue;
+            }
+            shadow->dirty[i] = 0;
+            shadow->num_dirty--;
+
+            dadr.sector = i - shadow->first[dadr.track - 1];
+            if (image->type == DISK_IMAGE_TYPE_P64) {
+                res = fsimage_p64_write_sector(image, shadow->data + i * 256, &dadr);
+            } else {
+                res = fsimage_gcr_write_sector(image, shadow->data + i * 256, &dadr);
+            }
+            if (res < 0) {
+                log_error(fsimage_shadow_log, "Could not write back T:%u S:%u.",
+                          dadr.track, dadr.sector);
+                rc = -1;
+            }
+        }
+    }
+
+    return rc;
+}
+
+/** \brief  Decode all tracks again on their next access
+ *
+ * Needed when the image is modified behind the shadow's back, written
+ * sectors must be flushed before.
+ */
+void fsimage_shadow_invalidate(fsimage_shadow_t *shadow)
+{
+    memset(shadow->state, SHADOW_TRACK_UNKNOWN, shadow->tracks);
+    memset(shadow->dirty, 0, shadow->first[shadow->tracks]);
+    shadow->num_dirty = 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
+void fsimage_shadow_init(void)
+{
+    fsimage_shadow_log = log_open("Sector Shadow");
+}
@@ -0,0 +1,60 @@
+/** \file   fsimage-shadow.h
+ *
+ * \brief   Decoded sector shadow of GCR based images - header
+ *
+ * This file is part of VICE, the Versatile Commodore Emulator.
+ * See README for copyright notice.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ *  02111-1307  USA.
+ *
+ */
+
+#ifndef VICE_FSIMAGE_SHADOW_H
+#define VICE_FSIMAGE_SHADOW_H
+
+#include "types.h"
+
+/** \brief  Keep decoded sectors of G64/G71/P64 images in memory
+ *
+ * Costs 256 bytes per sector of the image (about 170KB for a 1541 disk).
+ */
+#ifndef FSIMAGE_SHADOW
+#ifdef ARDUINO
+#define FSIMAGE_SHADOW 0
+#else
+#define FSIMAGE_SHADOW 1
+#endif
+#endif
+
+struct disk_image_s;
+struct disk_addr_s;
+
+typedef struct fsimage_shadow_s fsimage_shadow_t;
+
+void fsimage_shadow_init(void);
+
+fsimage_shadow_t *fsimage_shadow_create(const struct disk_image_s *image);
+void fsimage_shadow_destroy(fsimage_shadow_t *shadow);
+
+int fsimage_shadow_read(const struct disk_image_s *image, uint8_t *buf,
+                        const struct disk_addr_s *dadr);
+int fsimage_shadow_write(struct disk_image_s *image, const uint8_t *buf,
+                         const struct disk_addr_s *dadr);
+int fsimage_shadow_flush_due(const struct disk_image_s *image);
+int fsimage_shadow_flush(struct disk_image_s *image);
+void fsimage_shadow_invalidate(fsimage_shadow_t *shadow);
+
+#endif
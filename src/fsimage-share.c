@@ -0,0 +1,388 @@
+/** \file   fsimage-share.c
+ *
+ * \brief   Registry of images shared by read-only mounts
+ *
+ * The first read-only mount of an image makes the registry open an instance
+ * of its own.  That instance holds everything derived from the file: the
+ * mapped (or, where the platform can not map files, loaded) contents, the
+ * decoded sectors, the resident GCR tracks and the P64 pulse streams.  All
+ * read-only mounts of the same file, or of a file with identical contents,
+ * read their sectors through it, so all of this is built only once.
+ * Read-only mounts have no write-back sector cache.  The instance is closed
+ * with its last mount.
+ *
+ * A file is only taken to be the one already registered while its size and
+ * modification time are unchanged, otherwise its contents are compared.
+ * Where the platform does not report modification times the contents are
+ * always compared, and changes made to a file while it is mounted go
+ * unnoticed.
+ *
+ * The decoded state of a shared instance is built on access, so every read
+ * through it holds its lock, and mounts of the same file read one after
+ * another.  The registry has a lock of its own, which is taken first where
+ * both are needed.
+ *
+ * This file is part of VICE, the Versatile Commodore Emulator.
+ * See README for copyright notice.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ *  02111-1307  USA.
+ *
+ */
+
+#include <string.h>
+
+#include "archdep.h"
+#include "diskimage.h"
+#include "fsimage.h"
+#include "fsimage-share.h"
+#include "lib.h"
+#include "p64.h"
+#include "types.h"
+#include "util.h"
+
+/* read-only instance of an image, shared by all mounts of its contents */
+typedef struct fsimage_share_data_s {
+    disk_image_t *image;
+    size_t len;             /* size and modification time of its file when opened */
+    uint64_t mtime;
+    uint32_t hash;
+    int hashed;
+    unsigned int refs;
+    archdep_mutex_t lock;   /* held by every access to image */
+    struct fsimage_share_data_s *next;
+} fsimage_share_data_t;
+
+/* file name referring to a shared instance */
+struct fsimage_share_s {
+    char *name;
+    size_t len;             /* size and modification time of the file when mounted */
+    uint64_t mtime;
+    fsimage_share_data_t *d;
+    unsigned int refs;
+    struct fsimage_share_s *next;
+};
+
+static fsimage_share_data_t *share_data = NULL;
+static fsimage_share_t *share_names = NULL;
+static archdep_mutex_t share_lock = ARCHDEP_MUTEX_INITIALIZER;  /* guards both lists and all refs */
+
+
+/* FNV-1a */
+static uint32_t fsimage_share_hash(const uint8_t *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/* map or read a whole file, NULL if neither works */
+static uint8_t *fsimage_share_load(ADFILE *fd, size_t len, int *mapped)
+{
+    uint8_t *data;
+
+    data = archdep_fmap(fd, len, 0);
+    *mapped = data != NULL;
+    if (data == NULL) {
+        data = lib_malloc(len);
+        if (data == NULL || util_fpread(fd, data, len, 0) < 0) {
+            lib_free(data);
+            return NULL;
+        }
+    }
+
+    return data;
+}
+
+static void fsimage_share_free(uint8_t *data, size_t len, int mapped)
+{
+    if (mapped) {
+        archdep_funmap(data, len);
+    } else {
+        lib_free(data);
+    }
+}
+
+/* the file of the shared instance has not been changed since it was opened */
+static int fsimage_share_current(const fsimage_share_data_t *d)
+{
+    ADFILE *fd = d->image->media.fsimage->fd;
+
+    return archdep_file_size(fd) == (off_t)d->len && archdep_file_mtime(fd) == d->mtime;
+}
+
+/* the shared instance holds \a data, whose hash is \a hash */
+static int fsimage_share_same(fsimage_share_data_t *d, const uint8_t *data, uint32_t hash)
+{
+    fsimage_t *fsimage = d->image->media.fsimage;
+    uint8_t *own;
+    int loaded = 0, mapped = 0, same;
+
+    archdep_mutex_lock(&d->lock);
+
+    /* instances without a mapping (P64) are read for the comparison */
+    own = fsimage->mem.data;
+    if (own == NULL || fsimage->mem.len != d->len) {
+        own = fsimage_share_load(fsimage->fd, d->len, &mapped);
+        if (own == NULL) {
+            archdep_mutex_unlock(&d->lock);
+            return 0;
+        }
+        loaded = 1;
+    }
+
+    if (!d->hashed) {
+        d->hash = fsimage_share_hash(own, d->len);
+        d->hashed = 1;
+    }
+    same = d->hash == hash && memcmp(own, data, d->len) == 0;
+
+    if (loaded) {
+        fsimage_share_free(own, d->len, mapped);
+    }
+
+    archdep_mutex_unlock(&d->lock);
+    return same;
+}
+
+/* open the shared instance of \a name */
+static fsimage_share_data_t *fsimage_share_open(const char *name, unsigned int type)
+{
+    fsimage_share_data_t *d;
+    disk_image_t *image;
+    ADFILE *fd;
+
+    image = lib_calloc(1, sizeof(disk_image_t));
+    image->device = DISK_IMAGE_DEVICE_FS;
+    image->read_only = 1;
+    image->id = 0xffffffff;
+    image->p64 = lib_calloc(1, sizeof(TP64Image));
+    P64ImageCreate((void*)image->p64);
+    fsimage_media_create(image);
+    fsimage_name_set(image, name);
+    image->media.fsimage->share_owner = 1;
+
+    if (fsimage_open(image) < 0 || image->type != type) {
+        if (archdep_fisopen(image->media.fsimage->fd)) {
+            fsimage_close(image);
+        }
+        P64ImageDestroy((void*)image->p64);
+        lib_free(image->p64);
+        fsimage_media_destroy(image);
+        lib_free(image);
+        return NULL;
+    }
+
+    fd = image->media.fsimage->fd;
+    d = lib_calloc(1, sizeof(fsimage_share_data_t));
+    d->image = image;
+    d->len = (size_t)archdep_file_size(fd);
+    d->mtime = archdep_file_mtime(fd);
+    archdep_mutex_init(&d->lock);
+    d->next = share_data;
+    share_data = d;
+
+    return d;
+}
+
+static void fsimage_share_close(fsimage_share_data_t *d)
+{
+    disk_image_t *image = d->image;
+
+    fsimage_close(image);
+    P64ImageDestroy((void*)image->p64);
+    lib_free(image->p64);
+    fsimage_media_destroy(image);
+    lib_free(image);
+    archdep_mutex_destroy(&d->lock);
+    lib_free(d);
+}
+
+/* let the mount \a image read through \a n */
+static void fsimage_share_use(disk_image_t *image, fsimage_share_t *n)
+{
+    const disk_image_t *shared = n->d->image;
+
+    n->refs++;
+    n->d->refs++;
+    image->media.fsimage->share = n;
+    image->type = shared->type;
+    image->tracks = shared->tracks;
+    image->sectors = shared->sectors;
+    image->max_half_tracks = shared->max_half_tracks;
+    image->id = shared->id;
+}
+
+/** \brief  Find the shared instance of an image before it is probed
+ *
+ * Only succeeds if a read-only mount of the same file is open and the file
+ * has not been changed since, going by its size and modification time.
+ *
+ * \param[in,out]  image   read-only disk image, its file is open
+ *
+ * \return  0 if the image now reads through the shared instance (its type
+ *          and geometry have been set), -1 if it must be probed
+ */
+int fsimage_share_find(disk_image_t *image)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    fsimage_share_t *n;
+    uint64_t mtime;
+    off_t len;
+
+    len = archdep_file_size(fsimage->fd);
+    mtime = archdep_file_mtime(fsimage->fd);
+    if (len <= 0 || mtime == 0) {
+        return -1;
+    }
+
+    archdep_mutex_lock(&share_lock);
+    for (n = share_names; n != NULL; n = n->next) {
+        if (n->len == (size_t)len && n->mtime == mtime && strcmp(n->name, fsimage->name) == 0
+            && fsimage_share_current(n->d)) {
+            fsimage_share_use(image, n);
+            archdep_mutex_unlock(&share_lock);
+            return 0;
+        }
+    }
+    archdep_mutex_unlock(&share_lock);
+
+    return -1;
+}
+
+/** \brief  Share a probed read-only image with other mounts
+ *
+ * Uses the shared instance of a file with the same contents if there is
+ * one, otherwise opens a new one.
+ *
+ * \param[in,out]  image   read-only disk image, probed
+ *
+ * \return  0 if the image now reads through the shared instance, -1 if it
+ *          must be accessed on its own
+ */
+int fsimage_share_attach(disk_image_t *image)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    fsimage_share_data_t *d;
+    fsimage_share_t *n;
+    uint8_t *data = NULL;
+    uint32_t hash = 0;
+    int mapped = 0;
+    size_t len;
+    off_t flen;
+
+    flen = archdep_file_size(fsimage->fd);
+    if (flen <= 0) {
+        return -1;
+    }
+    len = (size_t)flen;
+
+    archdep_mutex_lock(&share_lock);
+
+    /* the contents are only hashed if there is an instance of the same size */
+    for (d = share_data; d != NULL; d = d->next) {
+        if (d->len != len || d->image->type != image->type || !fsimage_share_current(d)) {
+            continue;
+        }
+        if (data == NULL) {
+            data = fsimage_share_load(fsimage->fd, len, &mapped);
+            if (data == NULL) {
+                archdep_mutex_unlock(&share_lock);
+                return -1;
+            }
+            hash = fsimage_share_hash(data, len);
+        }
+        if (fsimage_share_same(d, data, hash)) {
+            break;
+        }
+    }
+
+    if (d == NULL) {
+        d = fsimage_share_open(fsimage->name, image->type);
+        if (d != NULL && data != NULL && d->len == len) {
+            d->hash = hash;
+            d->hashed = 1;
+        }
+    }
+    if (data != NULL) {
+        fsimage_share_free(data, len, mapped);
+    }
+    if (d == NULL) {
+        archdep_mutex_unlock(&share_lock);
+        return -1;
+    }
+
+    n = lib_calloc(1, sizeof(fsimage_share_t));
+    n->name = lib_strdup(fsimage->name);
+    n->len = len;
+    n->mtime = archdep_file_mtime(fsimage->fd);
+    n->d = d;
+    n->next = share_names;
+    share_names = n;
+
+    fsimage_share_use(image, n);
+    archdep_mutex_unlock(&share_lock);
+    return 0;
+}
+
+/** \brief  Lock the shared instance a mount reads through
+ *
+ * \return  the shared instance, to be accessed until fsimage_share_unlock()
+ */
+disk_image_t *fsimage_share_lock(const fsimage_share_t *share)
+{
+    archdep_mutex_lock(&share->d->lock);
+    return share->d->image;
+}
+
+/** \brief  Unlock the shared instance locked by fsimage_share_lock()
+ */
+void fsimage_share_unlock(const fsimage_share_t *share)
+{
+    archdep_mutex_unlock(&share->d->lock);
+}
+
+/** \brief  Stop sharing a mount, closes the shared instance with its last mount
+ */
+void fsimage_share_release(disk_image_t *image)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    fsimage_share_t **pn, *n = fsimage->share;
+    fsimage_share_data_t **pd, *d = n->d;
+
+    fsimage->share = NULL;
+
+    archdep_mutex_lock(&share_lock);
+    if (--n->refs == 0) {
+        for (pn = &share_names; *pn != n; pn = &(*pn)->next) {
+        }
+        *pn = n->next;
+        lib_free(n->name);
+        lib_free(n);
+    }
+
+    if (--d->refs == 0) {
+        for (pd = &share_data; *pd != d; pd = &(*pd)->next) {
+        }
+        *pd = d->next;
+        fsimage_share_close(d);
+    }
+    archdep_mutex_unlock(&share_lock);
+}
@@ -0,0 +1,38 @@
+/** \file   fsimage-share.h
+ *
+ * \brief   Registry of images shared by read-only mounts - header
+ *
+ * This file is part of VICE, the Versatile Commodore Emulator.
+ * See README for copyright notice.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ *  02111-1307  USA.
+ *
+ */
+
+#ifndef VICE_FSIMAGE_SHARE_H
+#define VICE_FSIMAGE_SHARE_H
+
+struct disk_image_s;
+
+typedef struct fsimage_share_s fsimage_share_t;
+
+int fsimage_share_find(struct disk_image_s *image);
+int fsimage_share_attach(struct disk_image_s *image);
+struct disk_image_s *fsimage_share_lock(const fsimage_share_t *share);
+void fsimage_share_unlock(const fsimage_share_t *share);
+void fsimage_share_release(struct disk_image_s *image);
+
+#endif
@@ -26,14 +26,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "archdep.h"
 #include "diskconstants.h"
 #include "diskimage.h"
+#include "fsimage-cache.h"
 #include "fsimage-dxx.h"
 #include "fsimage-gcr.h"
+#include "fsimage-overlay.h"
 #include "fsimage-p64.h"
 #include "fsimage-probe.h"
+#include "fsimage-shadow.h"
+#include "fsimage-share.h"
 #include "fsimage.h"
 #include "lib.h"
 #include "log.h"
@@ -41,6 +46,7 @@
 #include "zfile.h"
 #include "util.h"
 #include "cbmdos.h"
+#include "x64.h"
 
 
 static log_t fsimage_log = LOG_DEFAULT;
@@ -59,6 +65,37 @@ void fsimage_name_set(disk_image_t *image, const char *name)
     fsimage->name = lib_strdup(name);
 }
 
+/** \brief  Select whether the image is loaded into memory when opened
+ *
+ * Loaded images serve all accesses from memory, modified data is written
+ * back by fsimage_flush(), on close and after the write cache's flush
+ * interval has passed.
+ */
+void fsimage_ram_mode_set(disk_image_t *image, int enable)
+{
+    fsimage_t *fsimage;
+
+    fsimage = image->media.fsimage;
+
+    fsimage->ram_mode = enable;
+}
+
+/** \brief  Select a delta file for copy-on-write access to the image
+ *
+ * With a delta file the image itself is only opened for reading and may be
+ * shared between several clients, all modifications go to the delta file.
+ * Pass NULL to access the image directly.
+ */
+void fsimage_overlay_name_set(disk_image_t *image, const char *name)
+{
+    fsimage_t *fsimage;
+
+    fsimage = image->media.fsimage;
+
+    lib_free(fsimage->overlay_name);
+    fsimage->overlay_name = name ? lib_strdup(name) : NULL;
+}
+
 
 /** \brief  Get image name
  *
@@ -115,11 +152,225 @@ void fsimage_media_destroy(disk_image_t *image)
         fsimage_close(image);
     }
     lib_free(fsimage->name);
+    lib_free(fsimage->overlay_name);
     lib_free(fsimage);
 }
 
 /*-----------------------------------------------------------------------*/
 
+/* images handled by fsimage-dxx.c, storing plain sectors one after another */
+static int fsimage_is_flat(const disk_image_t *image)
+{
+    switch (image->type) {
+        case DISK_IMAGE_TYPE_D64:
+        case DISK_IMAGE_TYPE_D67:
+        case DISK_IMAGE_TYPE_D71:
+        case DISK_IMAGE_TYPE_D81:
+        case DISK_IMAGE_TYPE_D80:
+        case DISK_IMAGE_TYPE_D82:
+#ifdef HAVE_X64_IMAGE
+        case DISK_IMAGE_TYPE_X64:
+#endif
+        case DISK_IMAGE_TYPE_D1M:
+        case DISK_IMAGE_TYPE_D2M:
+        case DISK_IMAGE_TYPE_D4M:
+        case DISK_IMAGE_TYPE_DHD:
+        case DISK_IMAGE_TYPE_D90:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* images whose sectors are only accessed through fsimage_pread/pwrite() */
+static int fsimage_is_flat_or_gcr(const disk_image_t *image)
+{
+    return fsimage_is_flat(image)
+           || image->type == DISK_IMAGE_TYPE_G64 || image->type == DISK_IMAGE_TYPE_G71;
+}
+
+/** \brief  Map a flat (sector dump) image into memory
+ *
+ * Sector accesses of mapped images are served by the mapping instead of
+ * going through stdio.  Read-only G64/G71 images are mapped as well.  If the platform does not support memory mapped
+ * files the image is simply accessed through the file descriptor.
+ *
+ * \param[in,out]  image   disk image
+ */
+static void fsimage_mem_map(disk_image_t *image)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    off_t len;
+
+    /* GCR images may change size when written, so only map them read-only */
+    if (!(image->read_only ? fsimage_is_flat_or_gcr(image) : fsimage_is_flat(image))) {
+        return;
+    }
+
+    len = archdep_file_size(fsimage->fd);
+    if (len <= 0) {
+        return;
+    }
+
+    fsimage->mem.data = archdep_fmap(fsimage->fd, (size_t)len, !image->read_only);
+    fsimage->mem.len = fsimage->mem.data ? (size_t)len : 0;
+}
+
+/* error map stored inside the loaded image data */
+int fsimage_error_info_in_mem(const fsimage_t *fsimage)
+{
+    return fsimage->mem.loaded && fsimage->error_info.map != NULL
+           && fsimage->error_info.map >= fsimage->mem.data
+           && fsimage->error_info.map < fsimage->mem.data + fsimage->mem.len;
+}
+
+/* load the whole image into memory, the error map (if any) is moved into
+   the same buffer, falls back to mapping the file if it cannot be read */
+static void fsimage_mem_load(disk_image_t *image)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    size_t offset;
+    off_t len;
+
+    if (!fsimage_is_flat_or_gcr(image)) {
+        return;
+    }
+
+    len = archdep_file_size(fsimage->fd);
+    if (len <= 0) {
+        return;
+    }
+
+    fsimage->mem.data = lib_malloc((size_t)len);
+    if (fsimage->mem.data == NULL
+        || util_fpread(fsimage->fd, fsimage->mem.data, (size_t)len, 0) < 0) {
+        log_error(fsimage_log, "Cannot load `%s' into memory.", fsimage->name);
+        lib_free(fsimage->mem.data);
+        fsimage->mem.data = NULL;
+        fsimage_mem_map(image);
+        return;
+    }
+
+    fsimage->mem.len = (size_t)len;
+    fsimage->mem.loaded = 1;
+    fsimage->mem.dirty = lib_calloc((fsimage->mem.len + 255) / 256, 1);
+    fsimage->mem.num_dirty = 0;
+
+    if (fsimage->error_info.map != NULL) {
+        offset = (size_t)fsimage->error_info.len * 256;
+#ifdef HAVE_X64_IMAGE
+        if (image->type == DISK_IMAGE_TYPE_X64) {
+            offset += X64_HEADER_LENGTH;
+        }
+#endif
+        if (offset + (size_t)fsimage->error_info.len <= fsimage->mem.len) {
+            lib_free(fsimage->error_info.map);
+            fsimage->error_info.map = fsimage->mem.data + offset;
+        }
+    }
+}
+
+/* mark the loaded data in [offset, offset+num) as modified */
+static void fsimage_mem_set_dirty(fsimage_t *fsimage, size_t offset, size_t num)
+{
+    size_t i;
+
+    for (i = offset / 256; i <= (offset + num - 1) / 256; i++) {
+        if (!fsimage->mem.dirty[i]) {
+            if (fsimage->mem.num_dirty == 0) {
+                fsimage->mem.dirty_since = archdep_ticks_ms();
+            }
+            fsimage->mem.dirty[i] = 1;
+            fsimage->mem.num_dirty++;
+        }
+    }
+}
+
+static int fsimage_mem_flush_due(const fsimage_t *fsimage)
+{
+    return fsimage->mem.num_dirty > 0 && fsimage->mem.interval != 0
+           && (uint32_t)(archdep_ticks_ms() - fsimage->mem.dirty_since) >= fsimage->mem.interval;
+}
+
+/* write the modified blocks of a loaded image back to the file, runs of
+   consecutive blocks are written with a single request */
+static int fsimage_mem_write_back(fsimage_t *fsimage)
+{
+    size_t blocks, i, j, end;
+    int rc = 0;
+
+    if (!fsimage->mem.loaded || fsimage->mem.num_dirty == 0) {
+        return 0;
+    }
+
+    blocks = (fsimage->mem.len + 255) / 256;
+    for (i = 0; i < blocks; i = j) {
+        if (!fsimage->mem.dirty[i]) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < blocks && fsimage->mem.dirty[j]; j++) {
+        }
+        memset(fsimage->mem.dirty + i, 0, j - i);
+
+        end = j * 256 < fsimage->mem.len ? j * 256 : fsimage->mem.len;
+        if (util_fpwrite(fsimage->fd, fsimage->mem.data + i * 256, end - i * 256, (long)(i * 256)) < 0) {
+            log_error(fsimage_log, "Could not write back `%s'.", fsimage->name);
+            rc = -1;
+        }
+    }
+    fsimage->mem.num_dirty = 0;
+
+    return rc;
+}
+
+static void fsimage_mem_unmap(fsimage_t *fsimage)
+{
+    if (fsimage->mem.data) {
+        if (fsimage->mem.loaded) {
+            lib_free(fsimage->mem.data);
+            lib_free(fsimage->mem.dirty);
+            fsimage->mem.dirty = NULL;
+            fsimage->mem.loaded = 0;
+        } else {
+            archdep_funmap(fsimage->mem.data, fsimage->mem.len);
+        }
+        fsimage->mem.data = NULL;
+        fsimage->mem.len = 0;
+    }
+}
+
+/* The probe read the base image, pick up the error map from the delta file
+   and reject image types that are not written through fsimage_pwrite() */
+static int fsimage_overlay_check(disk_image_t *image)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    long offset;
+
+    if (!fsimage_is_flat_or_gcr(image)) {
+        log_error(fsimage_log, "Cannot use a delta file with `%s'.", fsimage->name);
+        return -1;
+    }
+
+    if (fsimage->error_info.map != NULL) {
+        offset = (long)fsimage->error_info.len * 256;
+#ifdef HAVE_X64_IMAGE
+        if (image->type == DISK_IMAGE_TYPE_X64) {
+            offset += X64_HEADER_LENGTH;
+        }
+#endif
+        if (fsimage_pread(fsimage, fsimage->error_info.map,
+                          (size_t)fsimage->error_info.len, offset) < 0) {
+            log_error(fsimage_log, "Cannot read error info of `%s'.", fsimage->name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*-----------------------------------------------------------------------*/
+
 int fsimage_open(disk_image_t *image)
 {
     fsimage_t *fsimage;
@@ -128,6 +379,18 @@ int fsimage_open(disk_image_t *image)
 
     fsimage = image->media.fsimage;
     fsimage->error_info.map = NULL;
+    fsimage->mem.data = NULL;
+    fsimage->mem.len = 0;
+    fsimage->mem.loaded = 0;
+    fsimage->share = NULL;
+    fsimage->cache = NULL;
+    fsimage->shadow = NULL;
+    fsimage->overlay = NULL;
+    fsimage->gcr.offsets = NULL;
+    fsimage->gcr.checked_half_track = 0;
+    fsimage->p64_gcr.tracks = NULL;
+    fsimage->p64_gcr.used = NULL;
+    fsimage->p64_gcr.num = 0;
 
     /* stat file to find out if it exists or if it is a directory */
     if (archdep_stat(fsimage->name, &length, &isdir) < 0) {
@@ -142,7 +405,18 @@ int fsimage_open(disk_image_t *image)
     }
 
     /* proceed with normal opening */
-    if (image->read_only) {
+    if (fsimage->overlay_name != NULL && !image->read_only) {
+        /* the image is shared, writes go to the delta file */
+        fsimage->fd = zfile_fopen(fsimage->name, MODE_READ);
+        if (archdep_fisopen(fsimage->fd)) {
+            fsimage->overlay = fsimage_overlay_open(fsimage->overlay_name, fsimage->fd);
+            if (fsimage->overlay == NULL) {
+                zfile_fclose(fsimage->fd);
+                fsimage->fd = archdep_fnofile();
+                return -1;
+            }
+        }
+    } else if (image->read_only) {
         fsimage->fd = zfile_fopen(fsimage->name, MODE_READ);
     } else {
         fsimage->fd = zfile_fopen(fsimage->name, MODE_READ_WRITE);
@@ -159,7 +433,38 @@ int fsimage_open(disk_image_t *image)
         return -1;
     }
 
+    /* read-only mounts of an unchanged file need not be probed again */
+    if (image->read_only && !fsimage->share_owner && fsimage_share_find(image) == 0) {
+        return 0;
+    }
+
     if (fsimage_probe(image) == 0) {
+        if (fsimage->overlay != NULL) {
+            if (fsimage_overlay_check(image) < 0) {
+                fsimage_close(image);
+                return -1;
+            }
+        } else if (fsimage->share_owner) {
+            fsimage_mem_map(image);
+            if (fsimage->mem.data == NULL) {
+                fsimage_mem_load(image);
+            }
+        } else if (image->read_only && fsimage_share_attach(image) == 0) {
+            /* all reads go to the shared instance */
+            if (image->p64 != NULL) {
+                P64ImageClear((void*)image->p64);
+            }
+            return 0;
+        } else if (fsimage->ram_mode) {
+            fsimage_mem_load(image);
+        } else {
+            fsimage_mem_map(image);
+        }
+        if (FSIMAGE_SHADOW && (image->type == DISK_IMAGE_TYPE_G64
+                               || image->type == DISK_IMAGE_TYPE_G71
+                               || image->type == DISK_IMAGE_TYPE_P64)) {
+            fsimage->shadow = fsimage_shadow_create(image);
+        }
         return 0;
     }
 
@@ -179,14 +484,32 @@ int fsimage_close(disk_image_t *image)
         return -1;
     }
 
+    fsimage_flush(image, 0);
+    fsimage_cache_destroy(fsimage->cache);
+    fsimage->cache = NULL;
+    fsimage_shadow_destroy(fsimage->shadow);
+    fsimage->shadow = NULL;
+    fsimage_gcr_drop_tracks(image);
+    lib_free(fsimage->gcr.offsets);
+    fsimage->gcr.offsets = NULL;
+    fsimage_p64_drop_tracks(image);
+
     /* flush the image when closed; added by Roberto Muscedere on 20210125 */
-    if (image->type == DISK_IMAGE_TYPE_P64) {
+    if (image->type == DISK_IMAGE_TYPE_P64 && fsimage->share == NULL) {
         fsimage_write_p64_image(image);
     }
 
-    if (fsimage->error_info.map) {
+    if (fsimage->error_info.map && !fsimage_error_info_in_mem(fsimage)) {
         lib_free(fsimage->error_info.map);
-        fsimage->error_info.map = NULL;
+    }
+    fsimage->error_info.map = NULL;
+    fsimage_mem_unmap(fsimage);
+    if (fsimage->share != NULL) {
+        fsimage_share_release(image);
+    }
+    if (fsimage->overlay != NULL) {
+        fsimage_overlay_close(fsimage->overlay);
+        fsimage->overlay = NULL;
     }
     zfile_fclose(fsimage->fd);
     fsimage->fd = archdep_fnofile();
@@ -206,6 +529,10 @@ int fsimage_read_sector_id(const disk_image_t *image, uint8_t *buf, const disk_a
     if (fsimage == NULL || !archdep_fisopen(fsimage->fd) ) {
         log_error(fsimage_log, "Attempt to read without disk image.");
     }
+    else if (fsimage->share != NULL) {
+      res = fsimage_read_sector_id(fsimage_share_lock(fsimage->share), buf, dadr);
+      fsimage_share_unlock(fsimage->share);
+    }
     else {
       switch (image->type) {
 
@@ -216,7 +543,7 @@ int fsimage_read_sector_id(const disk_image_t *image, uint8_t *buf, const disk_a
           bamadr.track = 18;
           bamadr.sector = 0;
           uint8_t bam[256];
-          res = fsimage_dxx_read_sector(image, bam, &bamadr);
+          res = fsimage_read_sector(image, bam, &bamadr);
           buf[0] = bam[BAM_ID_1541];
           buf[1] = bam[BAM_ID_1541+1];
           break;
@@ -250,6 +577,19 @@ int fsimage_read_sector(const disk_image_t *image, uint8_t *buf, const disk_addr
         return CBMDOS_IPE_NOT_READY;
     }
 
+    if (fsimage->share != NULL) {
+        int res = fsimage_read_sector(fsimage_share_lock(fsimage->share), buf, dadr);
+        fsimage_share_unlock(fsimage->share);
+        return res;
+    }
+
+    if (fsimage->cache != NULL && fsimage_cache_read(fsimage->cache, buf, dadr) == 0) {
+        return CBMDOS_IPE_OK;
+    }
+    if (fsimage->shadow != NULL && fsimage_shadow_read(image, buf, dadr) == 0) {
+        return CBMDOS_IPE_OK;
+    }
+
     switch (image->type) {
         case DISK_IMAGE_TYPE_D64:
         case DISK_IMAGE_TYPE_D67:
@@ -279,18 +619,82 @@ int fsimage_read_sector(const disk_image_t *image, uint8_t *buf, const disk_addr
     }
 }
 
-int fsimage_write_sector(disk_image_t *image, const uint8_t *buf,
-                         const disk_addr_t *dadr)
+/** \brief  Read a list of sectors
+ *
+ * Physically consecutive sectors of flat images are read with a single
+ * request, everything else is read sector by sector.
+ *
+ * \param[in]   list    sector addresses
+ * \param[in]   n       number of sectors in \a list
+ * \param[out]  bufs    \a n buffers of 256 bytes each
+ * \param[out]  errs    \a n result codes, same as fsimage_read_sector()
+ *
+ * \return 0 if all sectors were read without error, -1 otherwise
+ */
+int fsimage_read_sectors(const disk_image_t *image, const disk_addr_t *list,
+                         unsigned int n, uint8_t **bufs, int *errs)
 {
     fsimage_t *fsimage;
+    disk_addr_t *mlist;
+    uint8_t **mbufs;
+    int *merrs;
+    unsigned int *index;
+    unsigned int i, m;
+    int rc = 0;
 
     fsimage = image->media.fsimage;
 
-    if ( !archdep_fisopen(fsimage->fd) ) {
-        log_error(fsimage_log, "Attempt to write without disk image.");
-        return -1;
+    if (fsimage != NULL && fsimage->share != NULL) {
+        rc = fsimage_read_sectors(fsimage_share_lock(fsimage->share), list, n, bufs, errs);
+        fsimage_share_unlock(fsimage->share);
+        return rc;
     }
 
+    if (!fsimage_is_flat(image) || fsimage == NULL || !archdep_fisopen(fsimage->fd)) {
+        for (i = 0; i < n; i++) {
+            errs[i] = fsimage_read_sector(image, bufs[i], &list[i]);
+            if (errs[i] != CBMDOS_IPE_OK) {
+                rc = -1;
+            }
+        }
+        return rc;
+    }
+
+    /* serve cached sectors, collect the rest for the image backend */
+    mlist = lib_malloc(n * sizeof(disk_addr_t));
+    mbufs = lib_malloc(n * sizeof(uint8_t *));
+    merrs = lib_malloc(n * sizeof(int));
+    index = lib_malloc(n * sizeof(unsigned int));
+
+    for (i = 0, m = 0; i < n; i++) {
+        if (fsimage->cache != NULL
+            && fsimage_cache_read(fsimage->cache, bufs[i], &list[i]) == 0) {
+            errs[i] = CBMDOS_IPE_OK;
+        } else {
+            mlist[m] = list[i];
+            mbufs[m] = bufs[i];
+            index[m++] = i;
+        }
+    }
+
+    if (m > 0) {
+        rc = fsimage_dxx_read_sectors(image, mlist, m, mbufs, merrs);
+        for (i = 0; i < m; i++) {
+            errs[index[i]] = merrs[i];
+        }
+    }
+
+    lib_free(mlist);
+    lib_free(mbufs);
+    lib_free(merrs);
+    lib_free(index);
+
+    return rc;
+}
+
+static int fsimage_write_sector_direct(disk_image_t *image, const uint8_t *buf,
+                                       const disk_addr_t *dadr)
+{
     switch (image->type) {
         case DISK_IMAGE_TYPE_D64:
         case DISK_IMAGE_TYPE_D67:
@@ -328,6 +732,221 @@ int fsimage_write_sector(disk_image_t *image, const uint8_t *buf,
     return 0;
 }
 
+/* Write back the dirty sectors of the cache. With async set, sectors of flat
+   images are handed to the archdep I/O worker and may still be in flight when
+   this returns. */
+static int fsimage_write_back(disk_image_t *image, int async)
+{
+    fsimage_t *fsimage = image->media.fsimage;
+    const uint8_t *data;
+    disk_addr_t dadr;
+    int rc = 0;
+
+    while ((data = fsimage_cache_next_dirty(fsimage->cache, &dadr)) != NULL) {
+        if (async && fsimage_is_flat(image)
+            && fsimage_dxx_write_sector_async(image, data, &dadr) == 0) {
+            continue;
+        }
+        if (fsimage_write_sector_direct(image, data, &dadr) < 0) {
+            log_error(fsimage_log, "Could not write back T:%u S:%u.",
+                      dadr.track, dadr.sector);
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
+int fsimage_write_sector(disk_image_t *image, const uint8_t *buf,
+                         const disk_addr_t *dadr)
+{
+    fsimage_t *fsimage;
+
+    fsimage = image->media.fsimage;
+
+    if ( !archdep_fisopen(fsimage->fd) ) {
+        log_error(fsimage_log, "Attempt to write without disk image.");
+        return -1;
+    }
+
+    /* sectors of plain DOS tracks are encoded into GCR images on flush */
+    if (fsimage->shadow != NULL && fsimage_shadow_write(image, buf, dadr) == 0) {
+        if (fsimage_shadow_flush_due(image)
+            && (fsimage_shadow_flush(image) < 0 || fsimage_gcr_flush_tracks(image) < 0)) {
+            return -1;
+        }
+        if (fsimage_mem_flush_due(fsimage)) {
+            return fsimage_mem_write_back(fsimage);
+        }
+        return 0;
+    }
+
+    /* sectors outside the image are passed on so the backend reports the
+       error right away */
+    if (fsimage->cache == NULL
+        || disk_image_check_sector(image, dadr->track, dadr->sector) < 0) {
+        if (fsimage_write_sector_direct(image, buf, dadr) < 0) {
+            return -1;
+        }
+        /* modified GCR tracks and loaded images are written back once the
+           flush interval is over */
+        if (fsimage_gcr_flush_due(image) && fsimage_gcr_flush_tracks(image) < 0) {
+            return -1;
+        }
+        if (fsimage_mem_flush_due(fsimage)) {
+            return fsimage_mem_write_back(fsimage);
+        }
+        return 0;
+    }
+
+    if (fsimage_cache_write(fsimage->cache, buf, dadr) < 0) {
+        /* all slots dirty, make room */
+        if (fsimage_write_back(image, 1) < 0) {
+            return -1;
+        }
+        fsimage_cache_write(fsimage->cache, buf, dadr);
+    }
+
+    if (fsimage_cache_flush_due(fsimage->cache)
+        && fsimage_write_back(image, 1) < 0) {
+        return -1;
+    }
+
+    if (fsimage_gcr_flush_due(image)) {
+        return fsimage_gcr_flush_tracks(image);
+    }
+
+    return 0;
+}
+
+/** \brief  Write back the data whose flush interval has passed
+ *
+ * The flush interval is checked whenever a sector is written.  This must be
+ * called regularly so that data written last is not held back indefinitely
+ * once no more sectors are written.
+ *
+ * \param[in]  image   disk image
+ *
+ * \return 0 on success, -1 if any data could not be written
+ */
+int fsimage_poll(disk_image_t *image)
+{
+    fsimage_t *fsimage;
+    int rc = 0;
+
+    fsimage = image->media.fsimage;
+
+    if (fsimage == NULL || !archdep_fisopen(fsimage->fd)) {
+        return 0;
+    }
+
+    if (fsimage->cache != NULL && fsimage_cache_flush_due(fsimage->cache)
+        && fsimage_write_back(image, 1) < 0) {
+        rc = -1;
+    }
+    if (fsimage->shadow != NULL && fsimage_shadow_flush_due(image)
+        && (fsimage_shadow_flush(image) < 0 || fsimage_gcr_flush_tracks(image) < 0)) {
+        rc = -1;
+    }
+    if (fsimage_gcr_flush_due(image) && fsimage_gcr_flush_tracks(image) < 0) {
+        rc = -1;
+    }
+    if (fsimage_mem_flush_due(fsimage) && fsimage_mem_write_back(fsimage) < 0) {
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/** \brief  Write back all pending sectors and GCR tracks and flush the image file
+ *
+ * \param[in]  image       disk image
+ * \param[in]  invalidate  also drop the (clean) cached sectors and resident
+ *                         GCR tracks, needed when the image is modified
+ *                         behind the cache's back
+ *
+ * \return 0 on success, -1 if any sector could not be written
+ */
+int fsimage_flush(disk_image_t *image, int invalidate)
+{
+    fsimage_t *fsimage;
+    int rc = 0;
+
+    fsimage = image->media.fsimage;
+
+    if (fsimage == NULL || !archdep_fisopen(fsimage->fd)) {
+        return 0;
+    }
+
+    if (fsimage->cache != NULL) {
+        rc = fsimage_write_back(image, 0);
+        if (invalidate) {
+            fsimage_cache_invalidate(fsimage->cache);
+        }
+    }
+    if (fsimage->shadow != NULL) {
+        if (fsimage_shadow_flush(image) < 0) {
+            rc = -1;
+        }
+        if (invalidate) {
+            fsimage_shadow_invalidate(fsimage->shadow);
+        }
+    }
+    if (fsimage_gcr_flush_tracks(image) < 0) {
+        rc = -1;
+    }
+    if (invalidate) {
+        fsimage_gcr_drop_tracks(image);
+    }
+
+    if (fsimage_mem_write_back(fsimage) < 0) {
+        rc = -1;
+    }
+
+    if (fsimage->overlay != NULL && fsimage_overlay_flush(fsimage->overlay) < 0) {
+        rc = -1;
+    }
+
+    /* Make sure the stream is visible to other readers.  This also waits
+       for asynchronous write-backs to complete.  */
+    if (!image->read_only) {
+        archdep_fflush(fsimage->fd);
+    }
+
+    if (fsimage->io_error) {
+        log_error(fsimage_log, "Could not write back cached sectors.");
+        fsimage->io_error = 0;
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/** \brief  Configure the write-back sector cache of an open image
+ *
+ * \param[in]  size        number of cached sectors, 0 disables the cache
+ * \param[in]  max_dirty   number of dirty sectors that triggers a flush
+ * \param[in]  interval    maximum age of unwritten data in ms (0 = no limit)
+ */
+void fsimage_set_write_cache(disk_image_t *image, unsigned int size,
+                             unsigned int max_dirty, uint32_t interval)
+{
+    fsimage_t *fsimage;
+
+    fsimage = image->media.fsimage;
+
+    fsimage_flush(image, 0);
+    fsimage_cache_destroy(fsimage->cache);
+    fsimage->cache = NULL;
+
+    /* loaded and shadowed images do not need a cache, only the flush
+       interval applies */
+    fsimage->mem.interval = interval;
+    if (!image->read_only && !fsimage->mem.loaded && fsimage->shadow == NULL) {
+        fsimage->cache = fsimage_cache_create(size, max_dirty, interval);
+    }
+}
+
 /*-----------------------------------------------------------------------*/
 
 void fsimage_init(void)
@@ -336,6 +955,7 @@ void fsimage_init(void)
     fsimage_dxx_init();
     fsimage_gcr_init();
     fsimage_p64_init();
+    fsimage_shadow_init();
     fsimage_probe_init();
 }
 
@@ -348,3 +968,104 @@ off_t fsimage_size(const disk_image_t *image)
     fsimage = image->media.fsimage;
     return archdep_file_size(fsimage->fd);
 }
+
+/*-----------------------------------------------------------------------*/
+
+/** \brief  Read bytes from a position in the image
+ *
+ * Reads are served from the memory mapping where possible and fall back to
+ * the file for anything beyond the mapped range.  Images with a delta file
+ * are read through the overlay.
+ *
+ * \return  0 on success, -1 on error
+ */
+int fsimage_pread(const fsimage_t *fsimage, void *buf, size_t num, long offset)
+{
+    size_t n;
+
+    if (fsimage->overlay != NULL) {
+        return fsimage_overlay_read(fsimage->overlay, buf, num, offset);
+    }
+
+    if (fsimage->mem.data != NULL && offset >= 0
+        && (size_t)offset < fsimage->mem.len) {
+        n = fsimage->mem.len - (size_t)offset;
+        if (n > num) {
+            n = num;
+        }
+        memcpy(buf, fsimage->mem.data + offset, n);
+        if (n == num) {
+            return 0;
+        }
+        buf = (uint8_t *)buf + n;
+        num -= n;
+        offset += (long)n;
+    }
+
+    return util_fpread(fsimage->fd, buf, num, offset);
+}
+
+/** \brief  Read consecutive blocks from a position in the image
+ *
+ * \param[out]  bufs    \a count buffers of \a num bytes each
+ *
+ * \return  0 on success, -1 on error
+ */
+int fsimage_preadv(const fsimage_t *fsimage, uint8_t **bufs, size_t num,
+                   unsigned int count, long offset)
+{
+    unsigned int i;
+
+    if (fsimage->overlay == NULL
+        && (fsimage->mem.data == NULL || offset < 0
+            || (size_t)offset >= fsimage->mem.len)) {
+        return util_fpreadv(fsimage->fd, bufs, num, count, offset);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (fsimage_pread(fsimage, bufs[i], num, offset + (long)(i * num)) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/** \brief  Write bytes to a position in the image
+ *
+ * \return  0 on success, -1 on error
+ */
+int fsimage_pwrite(fsimage_t *fsimage, const void *buf, size_t num, long offset)
+{
+    size_t n;
+
+    if (fsimage->overlay != NULL) {
+        return fsimage_overlay_write(fsimage->overlay, buf, num, offset);
+    }
+    if (fsimage->share != NULL || fsimage->share_owner) {
+        log_error(fsimage_log, "Attempt to write to shared image `%s'.", fsimage->name);
+        return -1;
+    }
+
+    if (fsimage->mem.data != NULL && offset >= 0
+        && (size_t)offset < fsimage->mem.len) {
+        n = fsimage->mem.len - (size_t)offset;
+        if (n > num) {
+            n = num;
+        }
+        if (fsimage->mem.data + offset != buf) {
+            memcpy(fsimage->mem.data + offset, buf, n);
+        }
+        if (fsimage->mem.loaded) {
+            fsimage_mem_set_dirty(fsimage, (size_t)offset, n);
+        }
+        if (n == num) {
+            return 0;
+        }
+        buf = (const uint8_t *)buf + n;
+        num -= n;
+        offset += (long)n;
+    }
+
+    return util_fpwrite(fsimage->fd, buf, num, offset);
+}
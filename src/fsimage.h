@@ -34,6 +34,11 @@
 
 struct disk_image_s;
 struct disk_addr_s;
+struct fsimage_cache_s;
+struct fsimage_overlay_s;
+struct fsimage_share_s;
+struct fsimage_gcr_track_s;
+struct disk_track_s;
 
 typedef struct fsimage_s {
     ADFILE *fd;
@@ -43,12 +48,52 @@ typedef struct fsimage_s {
         int dirty;
         int len;
     } error_info;
+    struct {
+        uint8_t *data;  /* memory mapped or loaded image contents, NULL if neither */
+        size_t len;
+        int loaded;     /* data is a private copy that is written back on flush */
+        uint8_t *dirty; /* loaded images: one flag per modified 256 byte block */
+        unsigned int num_dirty;
+        uint32_t dirty_since;
+        uint32_t interval;  /* maximum age (ms) of unwritten data, 0 = no limit */
+    } mem;
+    int ram_mode;   /* load the whole image into memory when opening it */
+    char *overlay_name; /* delta file receiving all writes, NULL if none */
+    struct fsimage_overlay_s *overlay;
+    struct fsimage_share_s *share;  /* read-only mounts: registry entry of the
+                                       instance all reads go to, NULL if none */
+    int share_owner;    /* this is a shared instance, opened by the registry */
+    struct fsimage_cache_s *cache;  /* write-back sector cache, may be NULL */
+    struct fsimage_shadow_s *shadow;    /* decoded sectors of GCR images, may be NULL */
+    struct {
+        struct fsimage_gcr_track_s *tracks; /* resident G64/G71 half tracks */
+        unsigned int num;
+        unsigned int num_dirty;     /* tracks not yet written to the image */
+        uint32_t dirty_since;
+        uint32_t clock;
+    } track_cache;
+    struct {
+        uint32_t *offsets;  /* G64/G71 track offset table, NULL until parsed */
+        uint32_t *speeds;   /* speed zone table, stored behind the offsets */
+        uint16_t max_track_length;
+        uint8_t num_half_tracks;
+        unsigned int checked_half_track;    /* track number verified last, 0 = none */
+    } gcr;
+    struct {
+        struct disk_track_s *tracks;    /* GCR rendering of P64 half tracks */
+        uint32_t *used;     /* LRU stamps of the rendered tracks */
+        unsigned int num;
+        uint32_t clock;
+    } p64_gcr;
+    int io_error;   /* set when an asynchronous write-back failed */
 } fsimage_t;
 
 
 void fsimage_init(void);
 
 void fsimage_name_set(struct disk_image_s *image, const char *name);
+void fsimage_ram_mode_set(struct disk_image_s *image, int enable);
+void fsimage_overlay_name_set(struct disk_image_s *image, const char *name);
 const char *fsimage_name_get(const struct disk_image_s *image);
 ADFILE *fsimage_fd_get(const disk_image_t *image);
 void fsimage_media_create(struct disk_image_s *image);
@@ -62,6 +107,19 @@ int fsimage_read_sector(const struct disk_image_s *image, uint8_t *buf,
                         const struct disk_addr_s *dadr);
 int fsimage_write_sector(struct disk_image_s *image, const uint8_t *buf,
                          const struct disk_addr_s *dadr);
+int fsimage_read_sectors(const struct disk_image_s *image,
+                         const struct disk_addr_s *list, unsigned int n,
+                         uint8_t **bufs, int *errs);
 off_t fsimage_size(const disk_image_t *image);
+int fsimage_flush(struct disk_image_s *image, int invalidate);
+int fsimage_poll(struct disk_image_s *image);
+void fsimage_set_write_cache(struct disk_image_s *image, unsigned int size,
+                             unsigned int max_dirty, uint32_t interval);
+
+int fsimage_error_info_in_mem(const fsimage_t *fsimage);
+int fsimage_pread(const fsimage_t *fsimage, void *buf, size_t num, long offset);
+int fsimage_pwrite(fsimage_t *fsimage, const void *buf, size_t num, long offset);
+int fsimage_preadv(const fsimage_t *fsimage, uint8_t **bufs, size_t num,
+                   unsigned int count, long offset);
 
 #endif
@@ -63,48 +63,54 @@ static const uint8_t From_GCR_conv_data[32] =
 };
 
 
-static void gcr_convert_4bytes_to_GCR(const uint8_t *source, uint8_t *dest)
-{
-    int i;
-    register unsigned int tdest = 0;    /* at least 16 bits for overflow shifting */
+/* 10 bit GCR codes of all byte values */
+static uint16_t GCR_encode_table[256];
 
-    for (i = 2; i < 10; i += 2, source++, dest++)
-    {
-        tdest <<= 5;  /* make room for the upper nybble */
-        tdest |= GCR_conv_data[(*source) >> 4];
+/* Decoding table for pairs of 5 bit GCR codes: bits 0-7 hold the decoded
+   byte, bit 8 is set if either code is not a valid GCR code.  */
+static uint16_t GCR_decode_table[1024];
+
+static void gcr_init_tables(void)
+{
+    uint8_t valid[32];
+    unsigned int i;
 
-        tdest <<= 5;  /* make room for the lower nybble */
-        tdest |= GCR_conv_data[(*source) & 0x0f];
+    for (i = 0; i < 256; i++) {
+        GCR_encode_table[i] = (uint16_t)((GCR_conv_data[i >> 4] << 5) | GCR_conv_data[i & 0x0f]);
+    }
 
-        *dest = (uint8_t)(tdest >> i);
+    memset(valid, 0, sizeof(valid));
+    for (i = 0; i < 16; i++) {
+        valid[GCR_conv_data[i]] = 1;
     }
 
-    *dest = (uint8_t)tdest;
+    for (i = 0; i < 1024; i++) {
+        GCR_decode_table[i] = (uint16_t)((From_GCR_conv_data[i >> 5] << 4)
+                                         | From_GCR_conv_data[i & 0x1f]);
+        if (!valid[i >> 5] || !valid[i & 0x1f]) {
+            GCR_decode_table[i] |= 0x100;
+        }
+    }
 }
 
-static void gcr_convert_GCR_to_4bytes(const uint8_t *source, uint8_t *dest)
+static void gcr_convert_4bytes_to_GCR(const uint8_t *source, uint8_t *dest)
 {
-    int i;
-    /* at least 24 bits for shifting into bits 16...20 */
-    register uint32_t tdest = *source;
+    uint64_t w;
 
-    tdest <<= 13;
-
-    for (i = 5; i < 13; i += 2, dest++)
-    {
-        source++;
-        tdest |= ((uint32_t)(*source)) << i;
+    if (GCR_decode_table[0] == 0) {
+        gcr_init_tables();
+    }
 
-        /*  "tdest >> 16" could be optimized to a word
-         *  aligned access, hopefully the compiler does
-         *  this for us (in a portable way)
-         */
-        *dest = From_GCR_conv_data[(tdest >> 16) & 0x1f] << 4;
-        tdest <<= 5;
+    w = ((uint64_t)GCR_encode_table[source[0]] << 30)
+        | ((uint64_t)GCR_encode_table[source[1]] << 20)
+        | ((uint64_t)GCR_encode_table[source[2]] << 10)
+        | GCR_encode_table[source[3]];
 
-        *dest |= From_GCR_conv_data[(tdest >> 16) & 0x1f];
-        tdest <<= 5;
-    }
+    dest[0] = (uint8_t)(w >> 32);
+    dest[1] = (uint8_t)(w >> 24);
+    dest[2] = (uint8_t)(w >> 16);
+    dest[3] = (uint8_t)(w >> 8);
+    dest[4] = (uint8_t)w;
 }
 
 void gcr_convert_sector_to_GCR(const uint8_t *buffer, uint8_t *data, const gcr_header_t *header,
@@ -165,75 +171,140 @@ void gcr_convert_sector_to_GCR(const uint8_t *buffer, uint8_t *data, const gcr_h
     gcr_convert_4bytes_to_GCR(buf, data);
 }
 
+/* Get n (at most 54) bits starting at bit position pos, left aligned in
+   the result. Positions wrap around at the end of the track. */
+static uint64_t gcr_get_bits(const disk_track_t *raw, unsigned int pos, unsigned int n)
+{
+    const uint8_t *d;
+    uint64_t w;
+    unsigned int i, byte, nbytes = (unsigned int)raw->size;
+
+    byte = pos >> 3;
+    if (byte + 8 <= nbytes) {
+        d = raw->data + byte;
+        w = ((uint64_t)d[0] << 56) | ((uint64_t)d[1] << 48) | ((uint64_t)d[2] << 40)
+            | ((uint64_t)d[3] << 32) | ((uint64_t)d[4] << 24) | ((uint64_t)d[5] << 16)
+            | ((uint64_t)d[6] << 8) | d[7];
+        w <<= pos & 7;
+    } else {
+        w = 0;
+        for (i = 0; i < n; i++) {
+            w |= (uint64_t)((raw->data[byte] >> (7 - (pos & 7))) & 1) << (63 - i);
+            if (++pos >= nbytes * 8) {
+                pos = 0;
+            }
+            byte = pos >> 3;
+        }
+    }
+
+    return w & ~(~(uint64_t)0 >> n);
+}
+
+/* Find the end of a sync mark (the first 0 bit after at least ten 1 bits)
+   within s bits from position p. Bits are examined 54 at a time together
+   with the last 10 bits of the previous window: with W holding the window
+   MSB first, ~W & (W >> 1) & ... & (W >> 10) has a bit set wherever a 0
+   follows ten 1s. Only 1 bits seen after p count towards a sync. */
 static int gcr_find_sync(const disk_track_t *raw, int p, int s)
 {
-    unsigned int w;
-    int b;
+    uint64_t w, a, m;
+    unsigned int k, n, i, ctx = 0, nbits;
 
     if (!raw->data || !raw->size) {
         return -CBMDOS_FDC_ERR_SYNC;
     }
 
-    w = 0;
-    b = raw->data[p >> 3] << (p & 7);
-    while (s--) {
-        if (b & 0x80) {
-            w = (w << 1) | 1;
-        } else {
-            if (~w & 0x3ff) {
-                w <<= 1;
-            } else {
-                return p;
-            }
+    nbits = (unsigned int)raw->size * 8;
+    for (k = 0; k < (unsigned int)s; k += n) {
+        n = (unsigned int)s - k < 54 ? (unsigned int)s - k : 54;
+
+        w = ((uint64_t)ctx << 54) | (gcr_get_bits(raw, ((unsigned int)p + k) % nbits, n) >> 10);
+        a = w >> 1;
+        a &= a >> 1;                /* bits i-1..i-2 set */
+        a &= a >> 2;                /* i-1..i-4 */
+        a = (a & (a >> 4)) & (((w >> 1) & (w >> 2)) >> 8);   /* i-1..i-10 */
+
+        /* only the n new bits after the 10 bits of context */
+        m = ~w & a & (~(uint64_t)0 >> 10);
+        if (n < 54) {
+            m &= ~(~(uint64_t)0 >> (10 + n));
         }
-        if (~p & 7) {
-            p++;
-            b <<= 1;
-        } else {
-            p++;
-            if (p >= raw->size * 8) {
-                p = 0;
+        if (m != 0) {
+            for (i = 10; !(m & ((uint64_t)1 << (63 - i))); i++) {
             }
-            b = raw->data[p >> 3];
+            return (int)(((unsigned int)p + k + i - 10) % nbits);
         }
+
+        ctx = (unsigned int)(w >> (54 - n)) & 0x3ff;
     }
+
     return -CBMDOS_FDC_ERR_SYNC;
 }
 
-static void gcr_decode_block(const disk_track_t *raw, int p, uint8_t *buf, int num)
+/* Decode num groups of 5 GCR bytes starting at bit position p into 4 bytes
+   each. Each group is loaded as one 40 bit window (48 bits if p is not byte
+   aligned) and decoded with four table lookups. Blocks crossing the end of
+   the track are copied into a linear buffer first.
+   Returns -CBMDOS_FDC_ERR_DECODE if the block contains invalid GCR codes. */
+static int gcr_decode_block(const disk_track_t *raw, int p, uint8_t *buf, int num)
 {
-    int shift, i, j;
-    uint8_t gcr[5], b;
-    uint8_t *offset, *end = raw->data + raw->size;
+    uint8_t linear[65 * 5 + 1];
+    const uint8_t *src;
+    uint64_t w;
+    unsigned int shift, start, len, i, bad = 0;
+    uint16_t d0, d1, d2, d3;
+
+    if (GCR_decode_table[0] == 0) {
+        gcr_init_tables();
+    }
 
-    shift = p & 7;
-    offset = raw->data + (p >> 3);
+    shift = (unsigned int)p & 7;
+    start = (unsigned int)p >> 3;
+    len = (unsigned int)num * 5 + 1;
+
+    if (start + len <= (unsigned int)raw->size) {
+        src = raw->data + start;
+    } else {
+        /* only blocks of up to 65 groups (a data block) are decoded */
+        if (num > 65) {
+            num = 65;
+            len = (unsigned int)num * 5 + 1;
+        }
+        for (i = 0; i < len; i++) {
+            linear[i] = raw->data[(start + i) % (unsigned int)raw->size];
+        }
+        src = linear;
+    }
 
-    b = offset[0] << shift;
-    for (i = 0; i < num; i++, buf += 4) {
-        /* get 5 bytes of gcr data */
-        for (j = 0; j < 5; j++) {
-            offset++;
-            if (offset >= end) {
-                offset = raw->data;
-            }
-            if (shift) {
-                gcr[j] = b | ((offset[0] << shift) >> 8);
-                b = offset[0] << shift;
-            } else {
-                gcr[j] = b;
-                b = offset[0];
-            }
+    for (i = 0; i < (unsigned int)num; i++, src += 5, buf += 4) {
+        w = ((uint64_t)src[0] << 32) | ((uint64_t)src[1] << 24)
+            | ((uint64_t)src[2] << 16) | ((uint64_t)src[3] << 8) | src[4];
+        if (shift) {
+            w = ((w << 8) | src[5]) >> (8 - shift);
         }
-        gcr_convert_GCR_to_4bytes(gcr, buf);
+
+        d0 = GCR_decode_table[(w >> 30) & 0x3ff];
+        d1 = GCR_decode_table[(w >> 20) & 0x3ff];
+        d2 = GCR_decode_table[(w >> 10) & 0x3ff];
+        d3 = GCR_decode_table[w & 0x3ff];
+        buf[0] = (uint8_t)d0;
+        buf[1] = (uint8_t)d1;
+        buf[2] = (uint8_t)d2;
+        buf[3] = (uint8_t)d3;
+        bad |= d0 | d1 | d2 | d3;
     }
+
+    return (bad & 0x100) ? -CBMDOS_FDC_ERR_DECODE : 0;
 }
 
+/* Search for a header from the start of the track.  Sector lookups go
+   through the sector index, this is only used for the track number. */
 static int gcr_read_sector_header(const disk_track_t *raw, uint8_t *header, int sector, uint16_t *pid)
 {
     uint8_t cs;
-    int p2, id, i;
-    static int p = 0;
+    int p, p2, id, i;
+
+    p = 0;
 
     p2 = -CBMDOS_FDC_ERR_SYNC;
     for (;; ) {
@@ -269,21 +340,122 @@ static int gcr_read_sector_header(const disk_track_t *raw, uint8_t *header, int
 }
 
 
-static int gcr_find_sector_header(const disk_track_t *raw, uint8_t sector, uint16_t *pid)
+/* Positions of the sectors on a track, collected by scanning every header
+   once so that later lookups do not need to search the track.  */
+
+typedef struct gcr_sector_pos_s {
+    int header;     /* bit position of the header block, -1 if not found */
+    int data;       /* bit position of the data block or -(fdc error) */
+    uint16_t id;
+    uint8_t hcheck; /* header checksum error */
+} gcr_sector_pos_t;
+
+typedef struct gcr_index_s {
+    int sync;       /* the track has at least one sync mark */
+    unsigned int num;
+    gcr_sector_pos_t *sectors;  /* indexed by sector number */
+} gcr_index_t;
+
+static gcr_index_t *gcr_build_index(const disk_track_t *raw)
+{
+    gcr_index_t *index;
+    gcr_sector_pos_t *e;
+    uint8_t header[8], cs;
+    unsigned int i, sector;
+    int p, p2;
+
+    index = lib_calloc(1, sizeof(gcr_index_t));
+
+    p = 0;
+    p2 = -CBMDOS_FDC_ERR_SYNC;
+    for (;; ) {
+        p = gcr_find_sync(raw, p, raw->size * 8);
+        if (p < 0 || p == p2) {
+            break;
+        }
+        if (p2 < 0) {
+            p2 = p;
+        }
+        gcr_decode_block(raw, p, header, 2);
+        if (header[0] != 0x08) {
+            continue;
+        }
+
+        sector = header[2];
+        if (sector >= index->num) {
+            index->sectors = lib_realloc(index->sectors, (sector + 1) * sizeof(gcr_sector_pos_t));
+            for (i = index->num; i <= sector; i++) {
+                index->sectors[i].header = -1;
+            }
+            index->num = sector + 1;
+        }
+
+        /* the first good header of a sector wins */
+        cs = header[1] ^ header[2] ^ header[3] ^ header[4] ^ header[5];
+        e = &index->sectors[sector];
+        if (e->header < 0 || (e->hcheck && cs == 0)) {
+            e->header = p;
+            e->data = gcr_find_sync(raw, p, 500 * 8);
+            e->id = header[4] * 256 + header[5];
+            e->hcheck = cs != 0;
+        }
+    }
+    index->sync = p2 >= 0;
+
+    return index;
+}
+
+/* Look up a sector, returns NULL and sets *err if it is not usable */
+static const gcr_sector_pos_t *gcr_find_sector(const disk_track_t *raw, uint8_t sector,
+                                               uint16_t *pid, fdc_err_t *err)
+{
+    const gcr_sector_pos_t *e;
+
+    if (!raw->data || !raw->size) {
+        *err = CBMDOS_FDC_ERR_SYNC;
+        return NULL;
+    }
+
+    /* the index only caches what can be derived from the data */
+    if (raw->index == NULL) {
+        ((disk_track_t *)raw)->index = gcr_build_index(raw);
+    }
+
+    if (sector >= raw->index->num || raw->index->sectors[sector].header < 0) {
+        *err = raw->index->sync ? CBMDOS_FDC_ERR_HEADER : CBMDOS_FDC_ERR_SYNC;
+        return NULL;
+    }
+
+    e = &raw->index->sectors[sector];
+    if (pid) {
+        *pid = e->id;
+    }
+    if (e->hcheck) {
+        *err = CBMDOS_FDC_ERR_HCHECK;
+        return NULL;
+    }
+
+    return e;
+}
+
+/* Drop the sector index, needed whenever the track data is replaced or
+   modified other than through gcr_write_sector() */
+void gcr_invalidate_index(disk_track_t *raw)
 {
-  uint8_t header[8];
-  return gcr_read_sector_header(raw, header, sector, pid);
+    if (raw->index != NULL) {
+        lib_free(raw->index->sectors);
+        lib_free(raw->index);
+        raw->index = NULL;
+    }
 }
 
 
 fdc_err_t gcr_read_sector_id(const disk_track_t *raw, uint16_t *id, uint8_t sector)
 {
-  int p = gcr_find_sector_header(raw, sector, id);
-  if (p < 0) {
-    return -p;
-  }
-  else
-    return CBMDOS_FDC_ERR_OK;
+  fdc_err_t rf = CBMDOS_FDC_ERR_OK;
+
+  gcr_find_sector(raw, sector, id, &rf);
+  return rf;
 }
 
 
@@ -310,23 +482,24 @@ fdc_err_t gcr_read_sector(const disk_track_t *raw, uint8_t *data, uint8_t sector
     uint8_t buffer[260];
     uint8_t b;
     uint16_t sid;
-    int i, p;
+    const gcr_sector_pos_t *e;
+    fdc_err_t rf;
+    int i, decode;
 
-    p = gcr_find_sector_header(raw, sector, &sid);
-    if (p < 0) {
-        return -p;
+    e = gcr_find_sector(raw, sector, &sid, &rf);
+    if (e == NULL) {
+        return rf;
     }
     else if (id>=0 && id!=sid) {
       DBG(("GCR: id mismatch: expected %02X, found %02X", id, sid));
       return CBMDOS_FDC_ERR_ID;
     }
 
-    p = gcr_find_sync(raw, p, 500 * 8);
-    if (p < 0) {
-        return -p;
+    if (e->data < 0) {
+        return -e->data;
     }
 
-    gcr_decode_block(raw, p, buffer, 65);
+    decode = gcr_decode_block(raw, e->data, buffer, 65);
 
     b = buffer[257];
     for (i = 0; i < 256; i++) {
@@ -337,6 +510,9 @@ fdc_err_t gcr_read_sector(const disk_track_t *raw, uint8_t *data, uint8_t sector
     if (buffer[0] != 0x07) {
         return CBMDOS_FDC_ERR_NOBLOCK;
     }
+    if (decode < 0) {
+        return -decode;
+    }
 
     return b ? CBMDOS_FDC_ERR_DCHECK : CBMDOS_FDC_ERR_OK;
 }
@@ -347,20 +523,23 @@ fdc_err_t gcr_write_sector(disk_track_t *raw, const uint8_t *data, uint8_t secto
     uint8_t *end = raw->data + raw->size;
     uint8_t gcr[5], chksum, b;
     uint16_t sid;
+    const gcr_sector_pos_t *e;
+    fdc_err_t rf;
     int i, j, shift, p;
 
-    p = gcr_find_sector_header(raw, sector, &sid);
-    if (p < 0) {
-        return -p;
+    /* the data block is rewritten in place, the index stays valid */
+    e = gcr_find_sector(raw, sector, &sid, &rf);
+    if (e == NULL) {
+        return rf;
     }
     else if (id>=0 && id!=sid) {
       return CBMDOS_FDC_ERR_ID;
     }
 
-    p = gcr_find_sync(raw, p, 500 * 8);
-    if (p < 0) {
-        return -p;
+    if (e->data < 0) {
+        return -e->data;
     }
+    p = e->data;
 
     shift = p & 7;
     offset = raw->data + (p >> 3);
@@ -399,6 +578,15 @@ fdc_err_t gcr_write_sector(disk_track_t *raw, const uint8_t *data, uint8_t secto
     return CBMDOS_FDC_ERR_OK;
 }
 
+/* Release the data of a track */
+void gcr_free_track(disk_track_t *raw)
+{
+    gcr_invalidate_index(raw);
+    lib_free(raw->data);
+    raw->data = NULL;
+    raw->size = 0;
+}
+
 gcr_t *gcr_create_image(void)
 {
     return (gcr_t *)lib_calloc(1, sizeof(gcr_t));
@@ -406,6 +594,11 @@ gcr_t *gcr_create_image(void)
 
 void gcr_destroy_image(gcr_t *gcr)
 {
+    unsigned int i;
+
+    for (i = 0; i < MAX_GCR_TRACKS; i++) {
+        gcr_invalidate_index(&gcr->tracks[i]);
+    }
     lib_free(gcr);
     return;
 }
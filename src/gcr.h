@@ -48,9 +48,12 @@
    nor the gaps */
 #define SECTOR_GCR_SIZE_WITH_HEADER 335
 
+struct gcr_index_s;
+
 typedef struct disk_track_s {
     uint8_t *data;
     int size;
+    struct gcr_index_s *index;  /* sector positions, built on first lookup */
 } disk_track_t;
 
 typedef struct gcr_s {
@@ -69,6 +72,8 @@ enum fdc_err_e gcr_write_sector(disk_track_t *raw, const uint8_t *data, uint8_t
 
 enum fdc_err_e gcr_read_track_number(const disk_track_t *raw, uint8_t *track);
 enum fdc_err_e gcr_read_sector_id(const disk_track_t *raw, uint16_t *id, uint8_t sector);
+void gcr_invalidate_index(disk_track_t *raw);
+void gcr_free_track(disk_track_t *raw);
 
 gcr_t *gcr_create_image(void);
 void gcr_destroy_image(gcr_t *gcr);
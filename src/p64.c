@@ -28,7 +28,7 @@
 
 #include "p64.h"
 
-static p64_uint32_t P64CRC32(p64_uint8_t* Data, p64_uint32_t Len) {
+static p64_uint32_t P64CRC32Update(p64_uint32_t CRC, p64_uint8_t* Data, p64_uint32_t Len) {
 
     const p64_uint32_t CRC32Table[16] = {
         0x00000000UL, 0x1db71064UL, 0x3b6e20c8UL, 0x26d930acUL,
@@ -39,11 +39,7 @@ static p64_uint32_t P64CRC32(p64_uint8_t* Data, p64_uint32_t Len) {
 
     p64_uint32_t value, pos;
 
-    if(!Len) {
-        return 0;
-    }
-
-    for(value = 0xffffffffUL, pos = 0; pos < Len; pos++) {
+    for(value = CRC ^ 0xffffffffUL, pos = 0; pos < Len; pos++) {
         value ^= Data[pos];
         value = CRC32Table[value & 0xfUL] ^(value >> 4);
         value = CRC32Table[value & 0xfUL] ^(value >> 4);
@@ -52,6 +48,13 @@ static p64_uint32_t P64CRC32(p64_uint8_t* Data, p64_uint32_t Len) {
     return value ^ 0xffffffffUL;
 }
 
+static p64_uint32_t P64CRC32(p64_uint8_t* Data, p64_uint32_t Len) {
+    if(!Len) {
+        return 0;
+    }
+    return P64CRC32Update(0, Data, Len);
+}
+
 typedef p64_uint32_t* PP64RangeCoderProbabilities;
 
 typedef struct {
@@ -243,6 +246,14 @@ void P64MemoryStreamClear(PP64MemoryStream Instance) {
     memset(Instance, 0, sizeof(TP64MemoryStream));
 }
 
+/* Read Size bytes at Data in place, the stream must not be written to or destroyed */
+static void P64MemoryStreamView(PP64MemoryStream Instance, p64_uint8_t* Data, p64_uint32_t Size) {
+    Instance->Data = Data;
+    Instance->Allocated = Size;
+    Instance->Size = Size;
+    Instance->Position = 0;
+}
+
 p64_uint32_t P64MemoryStreamSeek(PP64MemoryStream Instance, p64_uint32_t Position) {
     if(Position < Instance->Size) {
         Instance->Position = Position;
@@ -396,6 +407,142 @@ p64_uint32_t P64MemoryStreamAppendFromCount(PP64MemoryStream Instance, PP64Memor
     return ToDo;
 }
 
+/* Pulse streams are normally kept flat: the positions and strengths of all
+   pulses in two arrays sorted by position, CurrentIndex indexing into them.
+   Appending pulses (as loading and converting from GCR do) keeps that form,
+   inserting or removing pulses elsewhere switches to the doubly linked list
+   and the next read access flattens the stream again.  A stream loaded
+   from an image may still be Pending, holding only its encoded chunk, which
+   is decoded by the first access to its pulses. */
+
+/* Forget the encoded chunk of a stream whose pulses change */
+static void P64PulseStreamModified(PP64PulseStream Instance) {
+    if(Instance->Chunk) {
+        p64_free(Instance->Chunk);
+    }
+    Instance->Chunk = 0;
+    Instance->ChunkSize = 0;
+    Instance->ChunkChecksum = 0;
+    Instance->Dirty = 1;
+}
+
+/* Decode the chunk of a pending stream, keeping it as the encoded form */
+static void P64PulseStreamDecodePending(PP64PulseStream Instance) {
+    TP64MemoryStream ChunkMemoryStream;
+    p64_uint8_t* Chunk;
+    p64_uint32_t ChunkSize, ChunkChecksum;
+    if(Instance->Pending) {
+        Instance->Pending = 0;
+        Chunk = Instance->Chunk;
+        ChunkSize = Instance->ChunkSize;
+        ChunkChecksum = Instance->ChunkChecksum;
+        /* detached, so that adding the pulses does not free it */
+        Instance->Chunk = 0;
+        P64MemoryStreamView(&ChunkMemoryStream, Chunk, ChunkSize);
+        P64PulseStreamReadFromStream(Instance, &ChunkMemoryStream);
+        Instance->Chunk = Chunk;
+        Instance->ChunkSize = ChunkSize;
+        Instance->ChunkChecksum = ChunkChecksum;
+        Instance->Dirty = 0;
+    }
+}
+
+static void P64PulseStreamFlatReserve(PP64PulseStream Instance, p64_uint32_t Count) {
+    if(Count > Instance->Allocated) {
+        if(Instance->Allocated < 16) {
+            Instance->Allocated = 16;
+        }
+        while(Count > Instance->Allocated) {
+            Instance->Allocated += Instance->Allocated;
+        }
+        if(Instance->Positions) {
+            Instance->Positions = p64_realloc(Instance->Positions, Instance->Allocated * sizeof(p64_uint32_t));
+            Instance->Strengths = p64_realloc(Instance->Strengths, Instance->Allocated * sizeof(p64_uint32_t));
+        } else {
+            Instance->Positions = p64_malloc(Instance->Allocated * sizeof(p64_uint32_t));
+            Instance->Strengths = p64_malloc(Instance->Allocated * sizeof(p64_uint32_t));
+        }
+    }
+}
+
+static void P64PulseStreamToList(PP64PulseStream Instance) {
+    p64_uint32_t Index, Count;
+    Count = Instance->Count;
+    Instance->PulsesAllocated = (Count < 16) ? 16 : Count;
+    Instance->Pulses = p64_malloc(Instance->PulsesAllocated * sizeof(TP64Pulse));
+    for(Index = 0; Index < Count; Index++) {
+        Instance->Pulses[Index].Previous = (p64_int32_t)Index - 1;
+        Instance->Pulses[Index].Next = ((Index + 1) < Count) ? (p64_int32_t)(Index + 1) : -1;
+        Instance->Pulses[Index].Position = Instance->Positions[Index];
+        Instance->Pulses[Index].Strength = Instance->Strengths[Index];
+    }
+    Instance->PulsesCount = Count;
+    Instance->UsedFirst = Count ? 0 : -1;
+    Instance->UsedLast = (p64_int32_t)Count - 1;
+    Instance->FreeList = -1;
+    Instance->Count = 0;
+    Instance->IsList = 1;
+}
+
+static void P64PulseStreamToFlat(PP64PulseStream Instance) {
+    p64_int32_t Current, CurrentIndex;
+    p64_uint32_t Count;
+    P64PulseStreamFlatReserve(Instance, Instance->PulsesCount);
+    Count = 0;
+    CurrentIndex = -1;
+    for(Current = Instance->UsedFirst; Current >= 0; Current = Instance->Pulses[Current].Next) {
+        if(Current == Instance->CurrentIndex) {
+            CurrentIndex = (p64_int32_t)Count;
+        }
+        Instance->Positions[Count] = Instance->Pulses[Current].Position;
+        Instance->Strengths[Count] = Instance->Pulses[Current].Strength;
+        Count++;
+    }
+    if(Instance->Pulses) {
+        p64_free(Instance->Pulses);
+    }
+    Instance->Pulses = 0;
+    Instance->PulsesAllocated = 0;
+    Instance->PulsesCount = 0;
+    Instance->UsedFirst = -1;
+    Instance->UsedLast = -1;
+    Instance->FreeList = -1;
+    Instance->CurrentIndex = CurrentIndex;
+    Instance->Count = Count;
+    Instance->IsList = 0;
+}
+
+/* Index of the first pulse at or after Position in a flat stream, Count if there is none */
+static p64_uint32_t P64PulseStreamFlatFind(PP64PulseStream Instance, p64_uint32_t Position) {
+    p64_uint32_t Low, High, Middle;
+    Low = 0;
+    High = Instance->Count;
+    if(Instance->CurrentIndex >= 0) {
+        /* sequential accesses mostly hit the current pulse or the one after it */
+        Middle = (p64_uint32_t)Instance->CurrentIndex;
+        if(Instance->Positions[Middle] < Position) {
+            Low = Middle + 1;
+            if((Low < High) && (Instance->Positions[Low] >= Position)) {
+                return Low;
+            }
+        } else {
+            if((Middle == 0) || (Instance->Positions[Middle - 1] < Position)) {
+                return Middle;
+            }
+            High = Middle;
+        }
+    }
+    while(Low < High) {
+        Middle = Low + ((High - Low) >> 1);
+        if(Instance->Positions[Middle] < Position) {
+            Low = Middle + 1;
+        } else {
+            High = Middle;
+        }
+    }
+    return Low;
+}
+
 void P64PulseStreamCreate(PP64PulseStream Instance) {
     memset(Instance, 0, sizeof(TP64PulseStream));
     Instance->Pulses = 0;
@@ -405,6 +552,16 @@ void P64PulseStreamCreate(PP64PulseStream Instance) {
     Instance->UsedLast = -1;
     Instance->FreeList = -1;
     Instance->CurrentIndex = -1;
+    Instance->Positions = 0;
+    Instance->Strengths = 0;
+    Instance->Count = 0;
+    Instance->Allocated = 0;
+    Instance->IsList = 0;
+    Instance->Chunk = 0;
+    Instance->ChunkSize = 0;
+    Instance->ChunkChecksum = 0;
+    Instance->Pending = 0;
+    Instance->Dirty = 1;
 }
 
 void P64PulseStreamDestroy(PP64PulseStream Instance) {
@@ -416,6 +573,12 @@ void P64PulseStreamClear(PP64PulseStream Instance) {
     if(Instance->Pulses) {
         p64_free(Instance->Pulses);
     }
+    if(Instance->Positions) {
+        p64_free(Instance->Positions);
+    }
+    if(Instance->Strengths) {
+        p64_free(Instance->Strengths);
+    }
     Instance->Pulses = 0;
     Instance->PulsesAllocated = 0;
     Instance->PulsesCount = 0;
@@ -423,10 +586,22 @@ void P64PulseStreamClear(PP64PulseStream Instance) {
     Instance->UsedLast = -1;
     Instance->FreeList = -1;
     Instance->CurrentIndex = -1;
+    Instance->Positions = 0;
+    Instance->Strengths = 0;
+    Instance->Count = 0;
+    Instance->Allocated = 0;
+    Instance->IsList = 0;
+    Instance->Pending = 0;
+    P64PulseStreamModified(Instance);
 }
 
 p64_int32_t P64PulseStreamAllocatePulse(PP64PulseStream Instance) {
     p64_int32_t Index;
+    P64PulseStreamDecodePending(Instance);
+    P64PulseStreamModified(Instance);
+    if(!Instance->IsList) {
+        P64PulseStreamToList(Instance);
+    }
     if(Instance->FreeList < 0) {
         if(Instance->PulsesCount >= Instance->PulsesAllocated) {
             if(Instance->PulsesAllocated < 16) {
@@ -454,6 +629,11 @@ p64_int32_t P64PulseStreamAllocatePulse(PP64PulseStream Instance) {
 }
 
 void P64PulseStreamFreePulse(PP64PulseStream Instance, p64_int32_t Index) {
+    P64PulseStreamDecodePending(Instance);
+    P64PulseStreamModified(Instance);
+    if(!Instance->IsList) {
+        P64PulseStreamToList(Instance);
+    }
     if(Instance->CurrentIndex == Index) {
         Instance->CurrentIndex = Instance->Pulses[Index].Next;
     }
@@ -474,9 +654,30 @@ void P64PulseStreamFreePulse(PP64PulseStream Instance, p64_int32_t Index) {
 
 void P64PulseStreamAddPulse(PP64PulseStream Instance, p64_uint32_t Position, p64_uint32_t Strength) {
     p64_int32_t Current, Index;
+    p64_uint32_t Count;
+    P64PulseStreamDecodePending(Instance);
     while(Position >= P64PulseSamplesPerRotation) {
         Position -= P64PulseSamplesPerRotation;
     }
+    P64PulseStreamModified(Instance);
+    if(!Instance->IsList) {
+        Count = Instance->Count;
+        if((Count == 0) || (Instance->Positions[Count - 1] < Position)) {
+            P64PulseStreamFlatReserve(Instance, Count + 1);
+            Instance->Positions[Count] = Position;
+            Instance->Strengths[Count] = Strength;
+            Instance->Count = Count + 1;
+            Instance->CurrentIndex = (p64_int32_t)Count;
+            return;
+        }
+        Index = (p64_int32_t)P64PulseStreamFlatFind(Instance, Position);
+        if(Instance->Positions[Index] == Position) {
+            Instance->Strengths[Index] = Strength;
+            Instance->CurrentIndex = Index;
+            return;
+        }
+        P64PulseStreamToList(Instance);
+    }
     Current = Instance->CurrentIndex;
     if((Instance->UsedLast >= 0) && (Instance->Pulses[Instance->UsedLast].Position < Position)) {
         Current = -1;
@@ -518,24 +719,33 @@ void P64PulseStreamAddPulse(PP64PulseStream Instance, p64_uint32_t Position, p64
 }
 
 void P64PulseStreamRemovePulses(PP64PulseStream Instance, p64_uint32_t Position, p64_uint32_t Count) {
-    p64_uint32_t ToDo;
+    p64_uint32_t ToDo, Index;
     p64_int32_t Current, Next;
+    P64PulseStreamDecodePending(Instance);
     while(Position >= P64PulseSamplesPerRotation) {
         Position -= P64PulseSamplesPerRotation;
     }
     while(Count) {
         ToDo = ((Position + Count) > P64PulseSamplesPerRotation) ? (P64PulseSamplesPerRotation - Position) : Count;
-        Current = Instance->CurrentIndex;
-        if((Current < 0) || ((Current != Instance->UsedFirst) && ((Instance->Pulses[Current].Previous >= 0) && (Instance->Pulses[Instance->Pulses[Current].Previous].Position >= Position)))) {
-            Current = Instance->UsedFirst;
-        }
-        while((Current >= 0) && (Instance->Pulses[Current].Position < Position)) {
-            Current = Instance->Pulses[Current].Next;
+        if(!Instance->IsList) {
+            Index = P64PulseStreamFlatFind(Instance, Position);
+            if((Index < Instance->Count) && (Instance->Positions[Index] < (Position + ToDo))) {
+                P64PulseStreamToList(Instance);
+            }
         }
-        while((Current >= 0) && ((Instance->Pulses[Current].Position >= Position) && (Instance->Pulses[Current].Position < (Position + ToDo)))) {
-            Next = Instance->Pulses[Current].Next;
-            P64PulseStreamFreePulse(Instance, Current);
-            Current = Next;
+        if(Instance->IsList) {
+            Current = Instance->CurrentIndex;
+            if((Current < 0) || ((Current != Instance->UsedFirst) && ((Instance->Pulses[Current].Previous >= 0) && (Instance->Pulses[Instance->Pulses[Current].Previous].Position >= Position)))) {
+                Current = Instance->UsedFirst;
+            }
+            while((Current >= 0) && (Instance->Pulses[Current].Position < Position)) {
+                Current = Instance->Pulses[Current].Next;
+            }
+            while((Current >= 0) && ((Instance->Pulses[Current].Position >= Position) && (Instance->Pulses[Current].Position < (Position + ToDo)))) {
+                Next = Instance->Pulses[Current].Next;
+                P64PulseStreamFreePulse(Instance, Current);
+                Current = Next;
+            }
         }
         Position += ToDo;
         Count -= ToDo;
@@ -544,9 +754,26 @@ void P64PulseStreamRemovePulses(PP64PulseStream Instance, p64_uint32_t Position,
 
 void P64PulseStreamRemovePulse(PP64PulseStream Instance, p64_uint32_t Position) {
     p64_int32_t Current;
+    p64_uint32_t Index;
+    P64PulseStreamDecodePending(Instance);
     while(Position >= P64PulseSamplesPerRotation) {
         Position -= P64PulseSamplesPerRotation;
     }
+    if(!Instance->IsList) {
+        Index = P64PulseStreamFlatFind(Instance, Position);
+        if((Index >= Instance->Count) || (Instance->Positions[Index] != Position)) {
+            return;
+        }
+        if((Index + 1) == Instance->Count) {
+            if(Instance->CurrentIndex == (p64_int32_t)Index) {
+                Instance->CurrentIndex = -1;
+            }
+            Instance->Count--;
+            P64PulseStreamModified(Instance);
+            return;
+        }
+        P64PulseStreamToList(Instance);
+    }
     Current = Instance->CurrentIndex;
     if((Current < 0) || ((Current != Instance->UsedFirst) && ((Instance->Pulses[Current].Previous >= 0) && (Instance->Pulses[Instance->Pulses[Current].Previous].Position >= Position)))) {
         Current = Instance->UsedFirst;
@@ -560,80 +787,75 @@ void P64PulseStreamRemovePulse(PP64PulseStream Instance, p64_uint32_t Position)
 }
 
 p64_uint32_t P64PulseStreamDeltaPositionToNextPulse(PP64PulseStream Instance, p64_uint32_t Position) {
-    p64_int32_t Current;
+    p64_uint32_t Index;
+    P64PulseStreamDecodePending(Instance);
     while(Position >= P64PulseSamplesPerRotation) {
         Position -= P64PulseSamplesPerRotation;
     }
-    Current = Instance->CurrentIndex;
-    if((Current < 0) || ((Current != Instance->UsedFirst) && ((Instance->Pulses[Current].Previous >= 0) && (Instance->Pulses[Instance->Pulses[Current].Previous].Position >= Position)))) {
-        Current = Instance->UsedFirst;
-    }
-    while((Current >= 0) && (Instance->Pulses[Current].Position < Position)) {
-        Current = Instance->Pulses[Current].Next;
+    if(Instance->IsList) {
+        P64PulseStreamToFlat(Instance);
     }
-    if(Current < 0) {
-        if(Instance->UsedFirst < 0) {
+    Index = P64PulseStreamFlatFind(Instance, Position);
+    if(Index >= Instance->Count) {
+        if(Instance->Count == 0) {
             return P64PulseSamplesPerRotation - Position;
         } else {
-            return (P64PulseSamplesPerRotation + Instance->Pulses[Instance->UsedFirst].Position) - Position;
+            return (P64PulseSamplesPerRotation + Instance->Positions[0]) - Position;
         }
     } else {
-        Instance->CurrentIndex = Current;
-        return Instance->Pulses[Current].Position - Position;
+        Instance->CurrentIndex = (p64_int32_t)Index;
+        return Instance->Positions[Index] - Position;
     }
 }
 
 p64_uint32_t P64PulseStreamGetNextPulse(PP64PulseStream Instance, p64_uint32_t Position) {
-    p64_int32_t Current;
+    p64_uint32_t Index;
+    P64PulseStreamDecodePending(Instance);
     while(Position >= P64PulseSamplesPerRotation) {
         Position -= P64PulseSamplesPerRotation;
     }
-    Current = Instance->CurrentIndex;
-    if((Current < 0) || ((Current != Instance->UsedFirst) && ((Instance->Pulses[Current].Previous >= 0) && (Instance->Pulses[Instance->Pulses[Current].Previous].Position >= Position)))) {
-        Current = Instance->UsedFirst;
-    }
-    while((Current >= 0) && (Instance->Pulses[Current].Position < Position)) {
-        Current = Instance->Pulses[Current].Next;
+    if(Instance->IsList) {
+        P64PulseStreamToFlat(Instance);
     }
-    if(Current < 0) {
-        if(Instance->UsedFirst < 0) {
+    Index = P64PulseStreamFlatFind(Instance, Position);
+    if(Index >= Instance->Count) {
+        if(Instance->Count == 0) {
             return 0;
         } else {
-            return Instance->Pulses[Instance->UsedFirst].Strength;
+            return Instance->Strengths[0];
         }
     } else {
-        Instance->CurrentIndex = Current;
-        return Instance->Pulses[Current].Strength;
+        Instance->CurrentIndex = (p64_int32_t)Index;
+        return Instance->Strengths[Index];
     }
 }
 
 p64_uint32_t P64PulseStreamGetPulseCount(PP64PulseStream Instance) {
-    p64_int32_t Current, Count = 0;
-    Current = Instance->CurrentIndex;
-    while(Current >= 0) {
-        Count++;
-        Current = Instance->Pulses[Current].Next;
+    P64PulseStreamDecodePending(Instance);
+    if(Instance->IsList) {
+        P64PulseStreamToFlat(Instance);
     }
-    return (p64_uint32_t)Count;
+    if(Instance->CurrentIndex < 0) {
+        return 0;
+    }
+    return Instance->Count - (p64_uint32_t)Instance->CurrentIndex;
 }
 
 p64_uint32_t P64PulseStreamGetPulse(PP64PulseStream Instance, p64_uint32_t Position) {
-    p64_int32_t Current;
+    p64_uint32_t Index;
+    P64PulseStreamDecodePending(Instance);
     while(Position >= P64PulseSamplesPerRotation) {
         Position -= P64PulseSamplesPerRotation;
     }
-    Current = Instance->CurrentIndex;
-    if((Current < 0) || ((Current != Instance->UsedFirst) && ((Instance->Pulses[Current].Previous >= 0) && (Instance->Pulses[Instance->Pulses[Current].Previous].Position >= Position)))) {
-        Current = Instance->UsedFirst;
+    if(Instance->IsList) {
+        P64PulseStreamToFlat(Instance);
     }
-    while((Current >= 0) && (Instance->Pulses[Current].Position < Position)) {
-        Current = Instance->Pulses[Current].Next;
-    }
-    if((Current < 0) || (Instance->Pulses[Current].Position != Position)) {
+    Index = P64PulseStreamFlatFind(Instance, Position);
+    if((Index >= Instance->Count) || (Instance->Positions[Index] != Position)) {
         return 0;
     } else {
-        Instance->CurrentIndex = Current;
-        return Instance->Pulses[Current].Strength;
+        Instance->CurrentIndex = (p64_int32_t)Index;
+        return Instance->Strengths[Index];
     }
 }
 
@@ -646,18 +868,16 @@ void P64PulseStreamSetPulse(PP64PulseStream Instance, p64_uint32_t Position, p64
 }
 
 void P64PulseStreamSeek(PP64PulseStream Instance, p64_uint32_t Position) {
-    p64_int32_t Current;
+    p64_uint32_t Index;
+    P64PulseStreamDecodePending(Instance);
     while(Position >= P64PulseSamplesPerRotation) {
         Position -= P64PulseSamplesPerRotation;
     }
-    Current = Instance->CurrentIndex;
-    if((Current < 0) || ((Current != Instance->UsedFirst) && ((Instance->Pulses[Current].Previous >= 0) && (Instance->Pulses[Instance->Pulses[Current].Previous].Position >= Position)))) {
-        Current = Instance->UsedFirst;
-    }
-    while((Current >= 0) && (Instance->Pulses[Current].Position < Position)) {
-        Current = Instance->Pulses[Current].Next;
+    if(Instance->IsList) {
+        P64PulseStreamToFlat(Instance);
     }
-    Instance->CurrentIndex = Current;
+    Index = P64PulseStreamFlatFind(Instance, Position);
+    Instance->CurrentIndex = (Index < Instance->Count) ? (p64_int32_t)Index : -1;
 }
 
 void P64PulseStreamConvertFromGCR(PP64PulseStream Instance, p64_uint8_t* Bytes, p64_uint32_t Len) {
@@ -684,15 +904,18 @@ void P64PulseStreamConvertFromGCR(PP64PulseStream Instance, p64_uint8_t* Bytes,
 }
 
 void P64PulseStreamConvertToGCR(PP64PulseStream Instance, p64_uint8_t* Bytes, p64_uint32_t Len) {
-    p64_uint32_t Range, PositionHi, PositionLo, IncrementHi, IncrementLo, BitStreamPosition;
-    p64_int32_t Current;
+    p64_uint32_t Range, PositionHi, PositionLo, IncrementHi, IncrementLo, BitStreamPosition, Current;
+    P64PulseStreamDecodePending(Instance);
     if(Len) {
+        if(Instance->IsList) {
+            P64PulseStreamToFlat(Instance);
+        }
         memset(Bytes, 0, (Len + 7) >> 3);
         Range = P64PulseSamplesPerRotation;
         IncrementHi = Range / Len;
         IncrementLo = Range % Len;
-        Current = Instance->UsedFirst;
-        PositionHi = (Current >= 0) ? Instance->Pulses[Current].Position - 1 : 0;
+        Current = 0;
+        PositionHi = Instance->Count ? Instance->Positions[0] - 1 : 0;
         PositionLo = Len - 1;
         for(BitStreamPosition = 0; BitStreamPosition < Len; BitStreamPosition++) {
             PositionHi += IncrementHi;
@@ -702,14 +925,14 @@ void P64PulseStreamConvertToGCR(PP64PulseStream Instance, p64_uint8_t* Bytes, p6
                 PositionHi++;
             }
             while(1) {
-                if((Current >= 0) && (Instance->Pulses[Current].Position < PositionHi)) {
-                    PositionHi = (Instance->Pulses[Current].Position + IncrementHi) - 20; /* 1.25 microseconds headroom */
+                if((Current < Instance->Count) && (Instance->Positions[Current] < PositionHi)) {
+                    PositionHi = (Instance->Positions[Current] + IncrementHi) - 20; /* 1.25 microseconds headroom */
                     PositionLo = IncrementLo;
-                    Current = Instance->Pulses[Current].Next;
+                    Current++;
                     Bytes[BitStreamPosition >> 3] |= (p64_uint8_t)(1 << ((~BitStreamPosition) & 7));
                 } else if(PositionHi >= Range) {
                     PositionHi -= Range;
-                    Current = Instance->UsedFirst;
+                    Current = 0;
                     continue;
                 }
                 break;
@@ -722,9 +945,12 @@ void P64PulseStreamConvertToGCR(PP64PulseStream Instance, p64_uint8_t* Bytes, p6
 }
 
 p64_uint32_t P64PulseStreamConvertToGCRWithLogic(PP64PulseStream Instance, p64_uint8_t* Bytes, p64_uint32_t Len, p64_uint32_t SpeedZone) {
-    p64_uint32_t Position, LastPosition, Delta, DelayCounter, FlipFlop, LastFlipFlop, Clock, Counter, BitStreamPosition;
-    p64_int32_t Current;
+    p64_uint32_t Position, LastPosition, Delta, DelayCounter, FlipFlop, LastFlipFlop, Clock, Counter, BitStreamPosition, Current;
+    P64PulseStreamDecodePending(Instance);
     if(Len) {
+        if(Instance->IsList) {
+            P64PulseStreamToFlat(Instance);
+        }
         memset(Bytes, 0, (Len + 7) >> 3);
         LastPosition = 0;
         FlipFlop = 0;
@@ -732,10 +958,9 @@ p64_uint32_t P64PulseStreamConvertToGCRWithLogic(PP64PulseStream Instance, p64_u
         Clock = SpeedZone;
         Counter = 0;
         BitStreamPosition = 0;
-        Current = Instance->UsedFirst;
-        while((Current >= 0) && (BitStreamPosition < Len)) {
-            if(Instance->Pulses[Current].Strength >= 0x80000000UL) {
-                Position = Instance->Pulses[Current].Position;
+        for(Current = 0; (Current < Instance->Count) && (BitStreamPosition < Len); Current++) {
+            if(Instance->Strengths[Current] >= 0x80000000UL) {
+                Position = Instance->Positions[Current];
                 Delta = Position - LastPosition;
                 LastPosition = Position;
                 DelayCounter = 0;
@@ -757,7 +982,6 @@ p64_uint32_t P64PulseStreamConvertToGCRWithLogic(PP64PulseStream Instance, p64_u
                     Clock++;
                 } while(++DelayCounter < Delta);
             }
-            Current = Instance->Pulses[Current].Next;
         }
 
         /* optional: add here GCR byte-realigning-to-syncmark-borders code, if your GCR routines are working bytewise-only */
@@ -785,6 +1009,7 @@ p64_uint32_t P64PulseStreamReadFromStream(PP64PulseStream Instance, PP64MemorySt
     TP64RangeCoder RangeCoderInstance;
     p64_uint32_t ProbabilityCount, Index, Count, DeltaPosition, Position, Strength, result, CountPulses, Size;
     p64_uint8_t *Buffer;
+    P64PulseStreamDecodePending(Instance);
 
     if(P64MemoryStreamReadDWord(Stream, &CountPulses)) {
 
@@ -822,6 +1047,11 @@ p64_uint32_t P64PulseStreamReadFromStream(PP64PulseStream Instance, PP64MemorySt
 
                 Strength = 0;
 
+                /* a rotation cannot hold more pulses than sample positions */
+                if(!Instance->IsList && (CountPulses <= P64PulseSamplesPerRotation)) {
+                    P64PulseStreamFlatReserve(Instance, Instance->Count + CountPulses);
+                }
+
 #define ReadBit(Model) (RangeCoderProbabilityStates[Model] = P64RangeCoderDecodeBit(&RangeCoderInstance, RangeCoderProbabilities + (RangeCoderProbabilityOffsets[Model] + RangeCoderProbabilityStates[Model]), 4))
 
 #define ReadDWord(Model) \
@@ -885,8 +1115,9 @@ p64_uint32_t P64PulseStreamWriteToStream(PP64PulseStream Instance, PP64MemoryStr
     p64_uint32_t RangeCoderProbabilityOffsets[ProbabilityModelCount];
     p64_uint32_t RangeCoderProbabilityStates[ProbabilityModelCount];
     TP64RangeCoder RangeCoderInstance;
-    p64_int32_t Index, Current;
-    p64_uint32_t ProbabilityCount, LastPosition, PreviousDeltaPosition, DeltaPosition, LastStrength, CountPulses, Size;
+    p64_int32_t Index;
+    p64_uint32_t ProbabilityCount, LastPosition, PreviousDeltaPosition, DeltaPosition, LastStrength, CountPulses, Size, Current;
+    P64PulseStreamDecodePending(Instance);
 
     ProbabilityCount = 0;
     for(Index = 0; Index < ProbabilityModelCount; Index++) {
@@ -924,9 +1155,12 @@ p64_uint32_t P64PulseStreamWriteToStream(PP64PulseStream Instance, PP64MemoryStr
 
     CountPulses = 0;
 
-    Current = Instance->UsedFirst;
-    while(Current >= 0) {
-        DeltaPosition = Instance->Pulses[Current].Position - LastPosition;
+    if(Instance->IsList) {
+        P64PulseStreamToFlat(Instance);
+    }
+
+    for(Current = 0; Current < Instance->Count; Current++) {
+        DeltaPosition = Instance->Positions[Current] - LastPosition;
         if(PreviousDeltaPosition != DeltaPosition) {
             PreviousDeltaPosition = DeltaPosition;
             WriteBit(ModelPositionFlag, 1);
@@ -934,19 +1168,17 @@ p64_uint32_t P64PulseStreamWriteToStream(PP64PulseStream Instance, PP64MemoryStr
         } else {
             WriteBit(ModelPositionFlag, 0);
         }
-        LastPosition = Instance->Pulses[Current].Position;
+        LastPosition = Instance->Positions[Current];
 
-        if(LastStrength != Instance->Pulses[Current].Strength) {
+        if(LastStrength != Instance->Strengths[Current]) {
             WriteBit(ModelStrengthFlag, 1);
-            WriteDWord(ModelStrength, Instance->Pulses[Current].Strength - LastStrength);
+            WriteDWord(ModelStrength, Instance->Strengths[Current] - LastStrength);
         } else {
             WriteBit(ModelStrengthFlag, 0);
         }
-        LastStrength = Instance->Pulses[Current].Strength;
+        LastStrength = Instance->Strengths[Current];
 
         CountPulses++;
-
-        Current = Instance->Pulses[Current].Next;
     }
 
     WriteBit(ModelPositionFlag, 1);
@@ -1013,11 +1245,125 @@ void P64ImageClear(PP64Image Instance) {
     }
 }
 
+/* The half track chunks of an image are independent, they are range
+   decoded and encoded in parallel through p64_parallel_for (if defined).
+   Only streams that need it are handed to it: those split into several
+   chunks when an image is read, and those modified since their chunk was
+   built when it is written.  All others only take a copy, or nothing. */
+
+#define P64HalfTrackCount ((P64LastHalfTrack - P64FirstHalfTrack) + 1)
+
+#ifdef p64_parallel_for
+#define P64ParallelFor p64_parallel_for
+#else
+static void P64ParallelFor(unsigned int Count, void (*Function)(void* Data, unsigned int Index), void* Data) {
+    unsigned int Index;
+    for(Index = 0; Index < Count; Index++) {
+        Function(Data, Index);
+    }
+}
+#endif
+
+typedef struct {
+    p64_uint8_t* Data;
+    p64_uint32_t Size;
+    p64_uint32_t Checksum;
+    p64_uint32_t Side;
+    p64_uint32_t HalfTrack;
+} TP64ChunkDescriptor;
+
+typedef struct {
+    PP64Image Instance;
+    TP64ChunkDescriptor* Chunks;
+    p64_uint32_t ChunkCount;
+    p64_uint32_t OK[2][P64HalfTrackCount];
+    p64_uint32_t Decode[2 * P64HalfTrackCount];
+    p64_uint32_t DecodeCount;
+} TP64ImageReadJob;
+
+static p64_uint32_t P64ImageCountChunks(TP64ImageReadJob* Job, unsigned int Index) {
+    p64_uint32_t Side, HalfTrack, Chunk, Chunks;
+    Side = Index / P64HalfTrackCount;
+    HalfTrack = P64FirstHalfTrack + (Index % P64HalfTrackCount);
+    Chunks = 0;
+    for(Chunk = 0; Chunk < Job->ChunkCount; Chunk++) {
+        if((Job->Chunks[Chunk].Side == Side) && (Job->Chunks[Chunk].HalfTrack == HalfTrack)) {
+            Chunks++;
+        }
+    }
+    return Chunks;
+}
+
+/* Take over the chunks of one pulse stream.  A stream stored in a single
+   chunk only copies it and is decoded when first accessed, or written back
+   unchanged if it never is.  Streams split into several chunks are decoded
+   right away, in file order. */
+static void P64ImageReadPulseStream(void* Data, unsigned int Index) {
+    TP64ImageReadJob* Job = (TP64ImageReadJob*)Data;
+    TP64MemoryStream ChunkMemoryStream;
+    PP64PulseStream PulseStream;
+    p64_uint32_t Side, HalfTrack, Chunk, Chunks, First, OK;
+    Side = Index / P64HalfTrackCount;
+    HalfTrack = P64FirstHalfTrack + (Index % P64HalfTrackCount);
+    PulseStream = &Job->Instance->PulseStreams[Side][HalfTrack];
+    OK = 1;
+    Chunks = 0;
+    First = 0;
+    for(Chunk = 0; Chunk < Job->ChunkCount; Chunk++) {
+        if((Job->Chunks[Chunk].Side == Side) && (Job->Chunks[Chunk].HalfTrack == HalfTrack)) {
+            if(!Chunks++) {
+                First = Chunk;
+            }
+        }
+    }
+    if(Chunks == 1) {
+        PulseStream->Chunk = p64_malloc(Job->Chunks[First].Size);
+        memcpy(PulseStream->Chunk, Job->Chunks[First].Data, Job->Chunks[First].Size);
+        PulseStream->ChunkSize = Job->Chunks[First].Size;
+        PulseStream->ChunkChecksum = Job->Chunks[First].Checksum;
+        PulseStream->Pending = 1;
+        PulseStream->Dirty = 0;
+        Job->OK[Side][HalfTrack - P64FirstHalfTrack] = OK;
+        return;
+    }
+    Chunks = 0;
+    for(Chunk = 0; OK && (Chunk < Job->ChunkCount); Chunk++) {
+        if((Job->Chunks[Chunk].Side == Side) && (Job->Chunks[Chunk].HalfTrack == HalfTrack)) {
+            OK = 0;
+            P64MemoryStreamCreate(&ChunkMemoryStream);
+            if(P64MemoryStreamWrite(&ChunkMemoryStream, Job->Chunks[Chunk].Data, Job->Chunks[Chunk].Size) == Job->Chunks[Chunk].Size) {
+                if(P64MemoryStreamSeek(&ChunkMemoryStream, 0) == 0) {
+                    OK = P64PulseStreamReadFromStream(PulseStream, &ChunkMemoryStream);
+                }
+            }
+            if(OK && (++Chunks == 1)) {
+                PulseStream->Chunk = ChunkMemoryStream.Data;
+                PulseStream->ChunkSize = Job->Chunks[Chunk].Size;
+                PulseStream->ChunkChecksum = Job->Chunks[Chunk].Checksum;
+                PulseStream->Dirty = 0;
+            } else {
+                P64MemoryStreamDestroy(&ChunkMemoryStream);
+            }
+        }
+    }
+    if(Chunks == 0) {
+        /* still empty, as in the image */
+        PulseStream->Dirty = 0;
+    }
+    Job->OK[Side][HalfTrack - P64FirstHalfTrack] = OK;
+}
+
+static void P64ImageDecodePulseStream(void* Data, unsigned int Index) {
+    TP64ImageReadJob* Job = (TP64ImageReadJob*)Data;
+    P64ImageReadPulseStream(Data, Job->Decode[Index]);
+}
+
 p64_uint32_t P64ImageReadFromStream(PP64Image Instance, PP64MemoryStream Stream) {
-    TP64MemoryStream ChunksMemoryStream, ChunkMemoryStream;
-    p64_uint32_t Version, Flags, Size, Checksum, HalfTrack, OK, side;
+    TP64MemoryStream ChunksMemoryStream;
+    p64_uint32_t Version, Flags, Size, Checksum, OK, Index, ChunksAllocated;
     TP64HeaderSignature HeaderSignature;
     TP64ChunkSignature ChunkSignature;
+    TP64ImageReadJob* Job;
 
     OK = 0;
     P64ImageClear(Instance);
@@ -1031,41 +1377,50 @@ p64_uint32_t P64ImageReadFromStream(PP64Image Instance, PP64MemoryStream Stream)
                                 if(P64MemoryStreamReadDWord(Stream, &Checksum)) {
                                     Instance->WriteProtected = (Flags & 1) != 0;
                                     Instance->noSides = 1+!!(Flags & 2);
-                                    P64MemoryStreamCreate(&ChunksMemoryStream);
-                                    if(P64MemoryStreamAppendFromCount(&ChunksMemoryStream, Stream, Size) == Size) {
+                                    if(Size <= (Stream->Size - Stream->Position)) {
+                                        /* the chunks are only looked at in place, those kept are copied */
+                                        P64MemoryStreamView(&ChunksMemoryStream, Stream->Data + Stream->Position, Size);
                                         if(P64CRC32(ChunksMemoryStream.Data, Size) == Checksum) {
                                             if(P64MemoryStreamSeek(&ChunksMemoryStream, 0) == 0) {
+                                                Job = p64_malloc(sizeof(TP64ImageReadJob));
+                                                memset(Job, 0, sizeof(TP64ImageReadJob));
+                                                Job->Instance = Instance;
+                                                ChunksAllocated = 0;
+
+                                                /* collect the half track chunks, checking the others on the way */
                                                 OK = 1;
                                                 while(OK && (ChunksMemoryStream.Position < ChunksMemoryStream.Size)) {
                                                     if(P64MemoryStreamRead(&ChunksMemoryStream, (void*)&ChunkSignature, sizeof(TP64ChunkSignature)) == sizeof(TP64ChunkSignature)) {
                                                         if(P64MemoryStreamReadDWord(&ChunksMemoryStream, &Size)) {
                                                             if(P64MemoryStreamReadDWord(&ChunksMemoryStream, &Checksum)) {
                                                                 OK = 0;
-                                                                P64MemoryStreamCreate(&ChunkMemoryStream);
                                                                 if(Size == 0) {
                                                                     if(Checksum == 0) {
-                                                                        if((ChunkSignature[0] == 'D') && (ChunkSignature[1] == 'O') && (ChunkSignature[2] == 'N') && (ChunkSignature[3] == 'E')) {
-                                                                            OK = 1;
-                                                                        } else {
-                                                                            OK = 1;
-                                                                        }
+                                                                        /* "DONE" or an empty unknown chunk */
+                                                                        OK = 1;
                                                                     }
-                                                                } else {
-                                                                    if(P64MemoryStreamAppendFromCount(&ChunkMemoryStream, &ChunksMemoryStream, Size) == Size) {
-                                                                        if(P64MemoryStreamSeek(&ChunkMemoryStream, 0) == 0) {
-                                                                            if(P64CRC32(ChunkMemoryStream.Data, Size) == Checksum) {
-                                                                                if((ChunkSignature[0] == 'H') && (ChunkSignature[1] == 'T') && (ChunkSignature[2] == 'P') && (((ChunkSignature[3] & 127) >= P64FirstHalfTrack) && ((ChunkSignature[3] & 127) <= P64LastHalfTrack))) {
-                                                                                    HalfTrack = ChunkSignature[3] & 127;
-                                                                                    side = !!(ChunkSignature[3] & 128);
-                                                                                    OK = P64PulseStreamReadFromStream(&Instance->PulseStreams[side][HalfTrack], &ChunkMemoryStream);
+                                                                } else if(Size <= (ChunksMemoryStream.Size - ChunksMemoryStream.Position)) {
+                                                                    if(P64CRC32(ChunksMemoryStream.Data + ChunksMemoryStream.Position, Size) == Checksum) {
+                                                                        if((ChunkSignature[0] == 'H') && (ChunkSignature[1] == 'T') && (ChunkSignature[2] == 'P') && (((ChunkSignature[3] & 127) >= P64FirstHalfTrack) && ((ChunkSignature[3] & 127) <= P64LastHalfTrack))) {
+                                                                            if(Job->ChunkCount >= ChunksAllocated) {
+                                                                                ChunksAllocated = ChunksAllocated ? ChunksAllocated * 2 : 2 * P64HalfTrackCount;
+                                                                                if(Job->Chunks) {
+                                                                                    Job->Chunks = p64_realloc(Job->Chunks, ChunksAllocated * sizeof(TP64ChunkDescriptor));
                                                                                 } else {
-                                                                                    OK = 1;
+                                                                                    Job->Chunks = p64_malloc(ChunksAllocated * sizeof(TP64ChunkDescriptor));
                                                                                 }
                                                                             }
+                                                                            Job->Chunks[Job->ChunkCount].Data = ChunksMemoryStream.Data + ChunksMemoryStream.Position;
+                                                                            Job->Chunks[Job->ChunkCount].Size = Size;
+                                                                            Job->Chunks[Job->ChunkCount].Checksum = Checksum;
+                                                                            Job->Chunks[Job->ChunkCount].Side = !!(ChunkSignature[3] & 128);
+                                                                            Job->Chunks[Job->ChunkCount].HalfTrack = ChunkSignature[3] & 127;
+                                                                            Job->ChunkCount++;
                                                                         }
+                                                                        OK = 1;
                                                                     }
+                                                                    ChunksMemoryStream.Position += Size;
                                                                 }
-                                                                P64MemoryStreamDestroy(&ChunkMemoryStream);
                                                                 continue;
                                                             }
                                                         }
@@ -1073,10 +1428,28 @@ p64_uint32_t P64ImageReadFromStream(PP64Image Instance, PP64MemoryStream Stream)
                                                     break;
                                                 }
 
+                                                if(OK && Job->ChunkCount) {
+                                                    Job->DecodeCount = 0;
+                                                    for(Index = 0; Index < (2 * P64HalfTrackCount); Index++) {
+                                                        if(P64ImageCountChunks(Job, Index) > 1) {
+                                                            Job->Decode[Job->DecodeCount++] = Index;
+                                                        } else {
+                                                            P64ImageReadPulseStream(Job, Index);
+                                                        }
+                                                    }
+                                                    P64ParallelFor(Job->DecodeCount, P64ImageDecodePulseStream, Job);
+                                                    for(Index = 0; Index < (2 * P64HalfTrackCount); Index++) {
+                                                        OK &= Job->OK[Index / P64HalfTrackCount][Index % P64HalfTrackCount];
+                                                    }
+                                                }
+
+                                                if(Job->Chunks) {
+                                                    p64_free(Job->Chunks);
+                                                }
+                                                p64_free(Job);
                                             }
                                         }
                                     }
-                                    P64MemoryStreamDestroy(&ChunksMemoryStream);
                                 }
                             }
                         }
@@ -1088,124 +1461,187 @@ p64_uint32_t P64ImageReadFromStream(PP64Image Instance, PP64MemoryStream Stream)
     return OK;
 }
 
-p64_uint32_t P64ImageWriteToStream(PP64Image Instance, PP64MemoryStream Stream) {
-    TP64MemoryStream MemoryStream, ChunksMemoryStream, ChunkMemoryStream;
-    p64_uint32_t Version, Flags, Size, Checksum, HalfTrack, result, WriteChunkResult, side;
+/* Read an image from Size bytes at Data, which need not stay valid afterwards */
+p64_uint32_t P64ImageReadFromBuffer(PP64Image Instance, p64_uint8_t* Data, p64_uint32_t Size) {
+    TP64MemoryStream Stream;
+    P64MemoryStreamView(&Stream, Data, Size);
+    return P64ImageReadFromStream(Instance, &Stream);
+}
 
-    TP64HeaderSignature HeaderSignature;
-    TP64ChunkSignature ChunkSignature;
+typedef struct {
+    PP64Image Instance;
+    p64_uint32_t Result[2][P64HalfTrackCount];
+    p64_uint32_t Encode[2 * P64HalfTrackCount];
+    p64_uint32_t EncodeCount;
+} TP64ImageWriteJob;
+
+/* Encode a pulse stream into its chunk unless the chunk is up to date */
+static void P64ImageWritePulseStream(void* Data, unsigned int Index) {
+    TP64ImageWriteJob* Job = (TP64ImageWriteJob*)Data;
+    TP64MemoryStream ChunkMemoryStream;
+    PP64PulseStream PulseStream;
+    p64_uint32_t Side, HalfTrack, Result;
+    Side = Index / P64HalfTrackCount;
+    HalfTrack = Index % P64HalfTrackCount;
+    PulseStream = &Job->Instance->PulseStreams[Side][P64FirstHalfTrack + HalfTrack];
+    Result = 1;
+    if(!PulseStream->Chunk) {
+        P64MemoryStreamCreate(&ChunkMemoryStream);
+        Result = P64PulseStreamWriteToStream(PulseStream, &ChunkMemoryStream);
+        if(Result) {
+            PulseStream->Chunk = ChunkMemoryStream.Data;
+            PulseStream->ChunkSize = ChunkMemoryStream.Size;
+            PulseStream->ChunkChecksum = P64CRC32(ChunkMemoryStream.Data, ChunkMemoryStream.Size);
+        } else {
+            P64MemoryStreamDestroy(&ChunkMemoryStream);
+        }
+    }
+    Job->Result[Side][HalfTrack] = Result;
+}
 
-#define WriteChunk() \
-{ \
-    WriteChunkResult = 0; \
-    Size = ChunkMemoryStream.Size; \
-    Checksum = (ChunkMemoryStream.Size > 0) ? P64CRC32(ChunkMemoryStream.Data,ChunkMemoryStream.Size) : 0; \
-    if (P64MemoryStreamWrite(&ChunksMemoryStream, (void*)&ChunkSignature, sizeof(TP64ChunkSignature)) == sizeof(TP64ChunkSignature)) { \
-        if (P64MemoryStreamWriteDWord(&ChunksMemoryStream, &Size)) { \
-            if (P64MemoryStreamWriteDWord(&ChunksMemoryStream, &Checksum)) { \
-                if (ChunkMemoryStream.Size == 0) { \
-                    WriteChunkResult = 1; \
-                }else{ \
-                    if (P64MemoryStreamSeek(&ChunkMemoryStream, 0) == 0) { \
-                        if (P64MemoryStreamAppendFromCount(&ChunksMemoryStream, &ChunkMemoryStream, ChunkMemoryStream.Size) == ChunkMemoryStream.Size) { \
-                            WriteChunkResult = 1; \
-                        } \
-                    } \
-          } \
-            } \
-        } \
-    } \
+static void P64ImageEncodePulseStream(void* Data, unsigned int Index) {
+    TP64ImageWriteJob* Job = (TP64ImageWriteJob*)Data;
+    P64ImageWritePulseStream(Data, Job->Encode[Index]);
 }
 
-    result = 0;
+static void P64PutDWord(p64_uint8_t* Buffer, p64_uint32_t Value) {
+    Buffer[0] = (p64_uint8_t)(Value & 0xffUL);
+    Buffer[1] = (p64_uint8_t)((Value >> 8) & 0xffUL);
+    Buffer[2] = (p64_uint8_t)((Value >> 16) & 0xffUL);
+    Buffer[3] = (p64_uint8_t)((Value >> 24) & 0xffUL);
+}
 
-    HeaderSignature[0] = 'P';
-    HeaderSignature[1] = '6';
-    HeaderSignature[2] = '4';
-    HeaderSignature[3] = '-';
-    HeaderSignature[4] = '1';
-    HeaderSignature[5] = '5';
-    HeaderSignature[6] = '4';
-    HeaderSignature[7] = '1';
-    Version = 0x00000000;
+static void P64PutChunkHeader(p64_uint8_t* Buffer, TP64ChunkSignature Signature, p64_uint32_t Size, p64_uint32_t Checksum) {
+    memcpy(Buffer, Signature, sizeof(TP64ChunkSignature));
+    P64PutDWord(Buffer + 4, Size);
+    P64PutDWord(Buffer + 8, Checksum);
+}
 
-    P64MemoryStreamCreate(&MemoryStream);
-    P64MemoryStreamCreate(&ChunksMemoryStream);
+/* Write an image through Function, in pieces.  Only pulse streams modified
+   since the image was loaded or last written are encoded, the chunks of
+   all others are written as they are. */
+p64_uint32_t P64ImageWriteToFunction(PP64Image Instance, TP64WriteFunction Function, void* Data) {
+    TP64ImageWriteJob* Job;
+    PP64PulseStream PulseStream;
+    p64_uint8_t Header[sizeof(TP64HeaderSignature) + 16], ChunkHeader[12];
+    TP64ChunkSignature ChunkSignature;
+    p64_uint32_t Flags, Size, Checksum, HalfTrack, side, Index, Count, result;
 
+    Count = (p64_uint32_t)Instance->noSides * P64HalfTrackCount;
+    Job = p64_malloc(sizeof(TP64ImageWriteJob));
+    memset(Job, 0, sizeof(TP64ImageWriteJob));
+    Job->Instance = Instance;
+    for(Index = 0; Index < Count; Index++) {
+        PulseStream = &Instance->PulseStreams[Index / P64HalfTrackCount][P64FirstHalfTrack + (Index % P64HalfTrackCount)];
+        if(PulseStream->Chunk) {
+            Job->Result[Index / P64HalfTrackCount][Index % P64HalfTrackCount] = 1;
+        } else {
+            Job->Encode[Job->EncodeCount++] = Index;
+        }
+    }
+    P64ParallelFor(Job->EncodeCount, P64ImageEncodePulseStream, Job);
     result = 1;
+    for(Index = 0; Index < Count; Index++) {
+        result &= Job->Result[Index / P64HalfTrackCount][Index % P64HalfTrackCount];
+    }
+    p64_free(Job);
+    if(!result) {
+        return 0;
+    }
+
+    /* the header holds size and checksum of all chunks following it */
+    Size = 0;
+    Checksum = 0;
     for (side = 0; side < (p64_uint32_t)Instance->noSides; side++) {
         for(HalfTrack = P64FirstHalfTrack; HalfTrack <= P64LastHalfTrack; HalfTrack++) {
-
-            P64MemoryStreamCreate(&ChunkMemoryStream);
-            result = P64PulseStreamWriteToStream(&Instance->PulseStreams[side][HalfTrack], &ChunkMemoryStream);
-            if(result) {
-                ChunkSignature[0] = 'H';
-                ChunkSignature[1] = 'T';
-                ChunkSignature[2] = 'P';
-                ChunkSignature[3] = (p64_uint8_t)(HalfTrack + 128*side);
-                WriteChunk();
-                result = WriteChunkResult;
-            }
-            P64MemoryStreamDestroy(&ChunkMemoryStream);
-            if(!result) {
-                break;
-            }
+            PulseStream = &Instance->PulseStreams[side][HalfTrack];
+            ChunkSignature[0] = 'H';
+            ChunkSignature[1] = 'T';
+            ChunkSignature[2] = 'P';
+            ChunkSignature[3] = (p64_uint8_t)(HalfTrack + 128*side);
+            P64PutChunkHeader(ChunkHeader, ChunkSignature, PulseStream->ChunkSize, PulseStream->ChunkChecksum);
+            Checksum = P64CRC32Update(Checksum, ChunkHeader, sizeof(ChunkHeader));
+            Checksum = P64CRC32Update(Checksum, PulseStream->Chunk, PulseStream->ChunkSize);
+            Size += sizeof(ChunkHeader) + PulseStream->ChunkSize;
         }
     }
+    ChunkSignature[0] = 'D';
+    ChunkSignature[1] = 'O';
+    ChunkSignature[2] = 'N';
+    ChunkSignature[3] = 'E';
+    P64PutChunkHeader(ChunkHeader, ChunkSignature, 0, 0);
+    Checksum = P64CRC32Update(Checksum, ChunkHeader, sizeof(ChunkHeader));
+    Size += sizeof(ChunkHeader);
+
+    Flags = 0;
+    if(Instance->WriteProtected) {
+        Flags |= 1;
+    }
+    if(Instance->noSides == 2) {
+        Flags |= 2;
+    }
 
-    if(result) {
+    memcpy(Header, "P64-1541", sizeof(TP64HeaderSignature));
+    P64PutDWord(Header + sizeof(TP64HeaderSignature), 0x00000000);
+    P64PutDWord(Header + sizeof(TP64HeaderSignature) + 4, Flags);
+    P64PutDWord(Header + sizeof(TP64HeaderSignature) + 8, Size);
+    P64PutDWord(Header + sizeof(TP64HeaderSignature) + 12, Checksum);
+    if(Function(Data, Header, sizeof(Header)) != sizeof(Header)) {
+        return 0;
+    }
 
-        P64MemoryStreamCreate(&ChunkMemoryStream);
-        ChunkSignature[0] = 'D';
-        ChunkSignature[1] = 'O';
-        ChunkSignature[2] = 'N';
-        ChunkSignature[3] = 'E';
-        WriteChunk();
-        result = WriteChunkResult;
-        P64MemoryStreamDestroy(&ChunkMemoryStream);
-
-        if(result) {
-            result = 0;
-
-            Flags = 0;
-            if(Instance->WriteProtected) {
-                Flags |= 1;
+    for (side = 0; side < (p64_uint32_t)Instance->noSides; side++) {
+        for(HalfTrack = P64FirstHalfTrack; HalfTrack <= P64LastHalfTrack; HalfTrack++) {
+            PulseStream = &Instance->PulseStreams[side][HalfTrack];
+            ChunkSignature[0] = 'H';
+            ChunkSignature[1] = 'T';
+            ChunkSignature[2] = 'P';
+            ChunkSignature[3] = (p64_uint8_t)(HalfTrack + 128*side);
+            P64PutChunkHeader(ChunkHeader, ChunkSignature, PulseStream->ChunkSize, PulseStream->ChunkChecksum);
+            if(Function(Data, ChunkHeader, sizeof(ChunkHeader)) != sizeof(ChunkHeader)) {
+                return 0;
             }
-            if(Instance->noSides == 2) {
-                Flags |= 2;
+            if(Function(Data, PulseStream->Chunk, PulseStream->ChunkSize) != PulseStream->ChunkSize) {
+                return 0;
             }
+        }
+    }
 
-            Size = ChunksMemoryStream.Size;
-            Checksum = P64CRC32(ChunksMemoryStream.Data, Size);
-
-            if(P64MemoryStreamWrite(&MemoryStream, (void*)&HeaderSignature, sizeof(TP64HeaderSignature)) == sizeof(TP64HeaderSignature)) {
-                if(P64MemoryStreamWriteDWord(&MemoryStream, &Version)) {
-                    if(P64MemoryStreamWriteDWord(&MemoryStream, &Flags)) {
-                        if(P64MemoryStreamWriteDWord(&MemoryStream, &Size)) {
-                            if(P64MemoryStreamWriteDWord(&MemoryStream, &Checksum)) {
-                                if(P64MemoryStreamSeek(&ChunksMemoryStream, 0) == 0) {
-                                    if(P64MemoryStreamAppendFromCount(&MemoryStream, &ChunksMemoryStream, ChunksMemoryStream.Size) == ChunksMemoryStream.Size) {
-                                        if(P64MemoryStreamSeek(&MemoryStream, 0) == 0) {
-                                            if(P64MemoryStreamAppendFromCount(Stream, &MemoryStream, MemoryStream.Size) == MemoryStream.Size) {
-                                                result = 1;
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+    ChunkSignature[0] = 'D';
+    ChunkSignature[1] = 'O';
+    ChunkSignature[2] = 'N';
+    ChunkSignature[3] = 'E';
+    P64PutChunkHeader(ChunkHeader, ChunkSignature, 0, 0);
+    if(Function(Data, ChunkHeader, sizeof(ChunkHeader)) != sizeof(ChunkHeader)) {
+        return 0;
+    }
 
+    for (side = 0; side < (p64_uint32_t)Instance->noSides; side++) {
+        for(HalfTrack = P64FirstHalfTrack; HalfTrack <= P64LastHalfTrack; HalfTrack++) {
+            Instance->PulseStreams[side][HalfTrack].Dirty = 0;
         }
-
     }
+    return 1;
+}
 
-    P64MemoryStreamDestroy(&ChunksMemoryStream);
-    P64MemoryStreamDestroy(&MemoryStream);
+static p64_uint32_t P64ImageWriteToMemoryStream(void* Data, p64_uint8_t* Buffer, p64_uint32_t Count) {
+    return P64MemoryStreamWrite((PP64MemoryStream)Data, Buffer, Count);
+}
 
-#undef WriteChunk
+p64_uint32_t P64ImageWriteToStream(PP64Image Instance, PP64MemoryStream Stream) {
+    return P64ImageWriteToFunction(Instance, P64ImageWriteToMemoryStream, Stream);
+}
 
-    return result;
+/* Check whether any pulse stream changed since the image was loaded or
+   last written */
+p64_uint32_t P64ImageIsDirty(PP64Image Instance) {
+    p64_int32_t HalfTrack, side;
+    for(side = 0; side < Instance->noSides; side++) {
+        for(HalfTrack = P64FirstHalfTrack; HalfTrack <= P64LastHalfTrack; HalfTrack++) {
+            if(Instance->PulseStreams[side][HalfTrack].Dirty) {
+                return 1;
+            }
+        }
+    }
+    return 0;
 }
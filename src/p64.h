@@ -107,6 +107,20 @@ typedef struct {
 	p64_int32_t UsedLast;
 	p64_int32_t FreeList;
 	p64_int32_t CurrentIndex;
+	/* flat form: pulses sorted by position, used unless IsList is set */
+	p64_uint32_t* Positions;
+	p64_uint32_t* Strengths;
+	p64_uint32_t Count;
+	p64_uint32_t Allocated;
+	p64_int32_t IsList;
+	/* encoded form of the pulses, NULL until loaded or encoded */
+	p64_uint8_t* Chunk;
+	p64_uint32_t ChunkSize;
+	p64_uint32_t ChunkChecksum;
+	/* pulses not decoded from Chunk yet, done on first access */
+	p64_int32_t Pending;
+	/* pulses changed since the image was last loaded or written */
+	p64_int32_t Dirty;
 } TP64PulseStream;
 
 typedef TP64PulseStream* PP64PulseStream;
@@ -132,6 +146,9 @@ typedef struct {
 
 typedef TP64MemoryStream* PP64MemoryStream;
 
+/* receives consecutive parts of an image, returns the number of bytes taken */
+typedef p64_uint32_t (*TP64WriteFunction)(void* Data, p64_uint8_t* Buffer, p64_uint32_t Count);
+
 void P64MemoryStreamCreate(PP64MemoryStream Instance);
 void P64MemoryStreamDestroy(PP64MemoryStream Instance);
 void P64MemoryStreamClear(PP64MemoryStream Instance);
@@ -173,6 +190,9 @@ void P64ImageCreate(PP64Image Instance);
 void P64ImageDestroy(PP64Image Instance);
 void P64ImageClear(PP64Image Instance);
 p64_uint32_t P64ImageReadFromStream(PP64Image Instance, PP64MemoryStream Stream);
+p64_uint32_t P64ImageReadFromBuffer(PP64Image Instance, p64_uint8_t* Data, p64_uint32_t Size);
 p64_uint32_t P64ImageWriteToStream(PP64Image Instance, PP64MemoryStream Stream);
+p64_uint32_t P64ImageWriteToFunction(PP64Image Instance, TP64WriteFunction Function, void* Data);
+p64_uint32_t P64ImageIsDirty(PP64Image Instance);
 
 #endif
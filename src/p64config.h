@@ -29,6 +29,7 @@
 #ifndef P64CONFIG_H
 #define P64CONFIG_H
 
+#include "archdep.h"
 #include "lib.h"
 #include "types.h"
 
@@ -40,4 +41,6 @@
 #define p64_realloc lib_realloc
 #define p64_free lib_free
 
+#define p64_parallel_for archdep_parallel_for
+
 #endif
@@ -439,8 +439,7 @@ void util_fname_split(const char *path, char **directory_return,
 
 int util_fpread(ADFILE *fd, void *buf, size_t num, long offset)
 {
-
-    if (archdep_fseek(fd, offset, SEEK_SET) < 0 || archdep_fread(buf, num, 1, fd) < 1) {
+    if (archdep_pread(buf, num, 1, offset, fd) < 1) {
         return -1;
     }
 
@@ -467,7 +466,36 @@ int util_fpread(ADFILE *fd, void *buf, size_t num, long offset)
 */
 int util_fpwrite(ADFILE *fd, const void *buf, size_t num, long offset)
 {
-    if (archdep_fseek(fd, offset, SEEK_SET) < 0 || archdep_fwrite(buf, num, 1, fd) < 1) {
+    if (archdep_pwrite(buf, num, 1, offset, fd) < 1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief Read consecutive blocks from a position in a file into separate buffers
+
+ \param fd
+   file descriptor as obtained by fopen().
+
+ \param bufs
+   array of \a count pointers to buffers of \a num bytes each
+
+ \param num
+   number of bytes per buffer.
+
+ \param count
+   number of buffers.
+
+ \param offset
+   the offset from start of file
+
+ \return
+   0 on success, else -1.
+
+*/
+int util_fpreadv(ADFILE *fd, uint8_t **bufs, size_t num, size_t count, long offset)
+{
+    if (archdep_preadv(bufs, num, count, offset, fd) < count) {
         return -1;
     }
     return 0;
@@ -63,6 +63,7 @@ int util_check_filename_access(const char *filename);
 
 int util_fpread(ADFILE *fd, void *buf, size_t num, long offset);
 int util_fpwrite(ADFILE *fd, const void *buf, size_t num, long offset);
+int util_fpreadv(ADFILE *fd, uint8_t **bufs, size_t num, size_t count, long offset);
 
 void util_dword_to_be_buf(uint8_t *buf, uint32_t data);
 void util_dword_to_le_buf(uint8_t *buf, uint32_t data);
@@ -323,12 +323,7 @@ int vdrive_get_max_sectors(vdrive_t *vdrive, unsigned int track)
         case VDRIVE_IMAGE_FORMAT_1581:
             return 40;
         case VDRIVE_IMAGE_FORMAT_8250:
-            if (track <= NUM_TRACKS_8250 / 2) {
-                return disk_image_sector_per_track(DISK_IMAGE_TYPE_D80, track);
-            } else {
-                return disk_image_sector_per_track(DISK_IMAGE_TYPE_D80, track
-                                                   - (NUM_TRACKS_8250 / 2));
-            }
+            return disk_image_sector_per_track(DISK_IMAGE_TYPE_D82, track);
         case VDRIVE_IMAGE_FORMAT_NP:
             return 256;
         case VDRIVE_IMAGE_FORMAT_9000:
@@ -798,34 +793,11 @@ void vdrive_set_last_read(unsigned int track, unsigned int sector, uint8_t *buff
     memcpy(last_read_buffer, buffer, 256);
 }
 
-static const signed int tosec4171[71] = {
-      -1,
-       0,   21,   42,   63,   84,  105,  126,  147,  168,  189, /* 1 */
-     210,  231,  252,  273,  294,  315,  336,  357,  376,  395,
-     414,  433,  452,  471,  490,  508,  526,  544,  562,  580,
-     598,  615,  632,  649,  666,
-     683,  704,  725,  746,  767,  788,  809,  830,  851,  872, /* 36 */
-     893,  914,  935,  956,  977,  998, 1019, 1040, 1059, 1078,
-    1097, 1116, 1135, 1154, 1173, 1191, 1209, 1227, 1245, 1263,
-    1281, 1298, 1315, 1332, 1349
-};
-
-static const signed int max4171[71] = {
-    -1,
-    21, 21, 21, 21, 21, 21, 21, 21, 21, 21, /* 1 */
-    21, 21, 21, 21, 21, 21, 21, 19, 19, 19,
-    19, 19, 19, 19, 18, 18, 18, 18, 18, 18,
-    17, 17, 17, 17, 17,
-    21, 21, 21, 21, 21, 21, 21, 21, 21, 21, /* 36 */
-    21, 21, 21, 21, 21, 21, 21, 19, 19, 19,
-    19, 19, 19, 19, 18, 18, 18, 18, 18, 18,
-    17, 17, 17, 17, 17
-};
-
 static int vdrive_log_to_phy(vdrive_t *vdrive, disk_addr_t *dadr, unsigned int track, unsigned int sector)
 {
     /* allows us to access CMD partitions without a lot of code changes */
     unsigned int offset;
+    const disk_image_geometry_t *geo;
 
     /* if no partition set, return -1, eventually becomes a drive not ready */
     if (vdrive->current_offset == UINT32_MAX || !vdrive->image) {
@@ -839,22 +811,16 @@ static int vdrive_log_to_phy(vdrive_t *vdrive, disk_addr_t *dadr, unsigned int t
 
         switch (vdrive->image_format) {
             case VDRIVE_IMAGE_FORMAT_1541:
-                if (track > 35) {
-                    return -1;
-                }
-                if (sector >= max4171[track]) {
-                    return -1;
-                }
-                offset = tosec4171[track] + sector;
-                break;
             case VDRIVE_IMAGE_FORMAT_1571:
-                if (track > 70) {
+                /* both use the D71 layout, the 1541 one being its first side */
+                if (track > (vdrive->image_format == VDRIVE_IMAGE_FORMAT_1541 ? 35 : 70)) {
                     return -1;
                 }
-                if (sector >= max4171[track]) {
+                geo = disk_image_geometry(DISK_IMAGE_TYPE_D71);
+                if (sector >= geo->sectors[track]) {
                     return -1;
                 }
-                offset = tosec4171[track] + sector;
+                offset = geo->offset[track] + sector;
                 break;
             case VDRIVE_IMAGE_FORMAT_1581:
                 if (track > 80) {
@@ -993,6 +959,55 @@ int vdrive_read_sector(vdrive_t *vdrive, uint8_t *buf, unsigned int track, unsig
     return ret;
 }
 
+/* Read a list of logical sectors, errs[] receives the result of each sector
+   (as returned by vdrive_read_sector). Returns 0 if all sectors were read. */
+int vdrive_read_sectors(vdrive_t *vdrive, const disk_addr_t *list, unsigned int n, uint8_t **bufs, int *errs)
+{
+    disk_addr_t *plist;
+    uint8_t **pbufs;
+    int *perrs;
+    unsigned int *index;
+    unsigned int i, m;
+    int ret = 0;
+
+    /* update image mode if disk is attached */
+    if (vdrive->image) {
+        vdrive->image_mode = vdrive->image->read_only;
+    }
+
+    plist = lib_malloc(n * sizeof(disk_addr_t));
+    pbufs = lib_malloc(n * sizeof(uint8_t *));
+    perrs = lib_malloc(n * sizeof(int));
+    index = lib_malloc(n * sizeof(unsigned int));
+
+    for (i = 0, m = 0; i < n; i++) {
+        if (vdrive->image_mode < 0
+            || vdrive_log_to_phy(vdrive, &plist[m], list[i].track, list[i].sector) < 0) {
+            errs[i] = CBMDOS_IPE_NOT_READY;
+            ret = -1;
+        } else {
+            pbufs[m] = bufs[i];
+            index[m++] = i;
+        }
+    }
+
+    if (m > 0) {
+        if (disk_image_read_sectors(vdrive->image, plist, m, pbufs, perrs) < 0) {
+            ret = -1;
+        }
+        for (i = 0; i < m; i++) {
+            errs[index[i]] = perrs[i];
+        }
+    }
+
+    lib_free(plist);
+    lib_free(pbufs);
+    lib_free(perrs);
+    lib_free(index);
+
+    return ret;
+}
+
 int vdrive_write_sector(vdrive_t *vdrive, const uint8_t *buf, unsigned int track, unsigned int sector)
 {
     disk_addr_t dadr;
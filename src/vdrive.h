@@ -133,6 +133,7 @@ typedef struct bufferinfo_s {
 } bufferinfo_t;
 
 struct disk_image_s;
+struct disk_addr_s;
 
 /* Run-time data struct for each drive. */
 typedef struct vdrive_s {
@@ -243,6 +244,7 @@ void vdrive_free_buffer(struct bufferinfo_s *p);
 void vdrive_set_disk_geometry(vdrive_t *vdrive);
 int vdrive_read_sector(vdrive_t *vdrive, uint8_t *buf, unsigned int track, unsigned int sector);
 int vdrive_write_sector(vdrive_t *vdrive, const uint8_t *buf, unsigned int track, unsigned int sector);
+int vdrive_read_sectors(vdrive_t *vdrive, const struct disk_addr_s *list, unsigned int n, uint8_t **bufs, int *errs);
 int vdrive_read_sector_physical(vdrive_t *vdrive, uint8_t *buf, unsigned int track, unsigned int sector);
 int vdrive_write_sector_physical(vdrive_t *vdrive, const uint8_t *buf, unsigned int track, unsigned int sector);
 